@@ -0,0 +1,27 @@
+//*****************************************************************************
+// bob: Interned names
+//
+// Eli Bendersky (eliben@gmail.com)
+// This code is in the public domain
+//*****************************************************************************
+#include "atom.h"
+#include <unordered_map>
+
+using namespace std;
+
+
+const BobAtom* BobAtom::intern(const string& name)
+{
+    // The table is a function-local static so that atoms can be interned
+    // during static initialization of other modules.
+    //
+    static unordered_map<string, BobAtom*> atom_table;
+
+    unordered_map<string, BobAtom*>::const_iterator it = atom_table.find(name);
+    if (it != atom_table.end())
+        return it->second;
+
+    BobAtom* atom = new BobAtom(name);
+    atom_table[name] = atom;
+    return atom;
+}
@@ -0,0 +1,42 @@
+//*****************************************************************************
+// bob: Interned names
+//
+// Eli Bendersky (eliben@gmail.com)
+// This code is in the public domain
+//*****************************************************************************
+#ifndef ATOM_H
+#define ATOM_H
+
+#include <string>
+
+
+// An interned name. There's exactly one BobAtom for every distinct name
+// string, so atoms can be compared and used as map keys by pointer.
+//
+// Atoms aren't BobObjects: they're never garbage-collected and live until
+// the program exits.
+//
+class BobAtom
+{
+public:
+    // Return the atom for the given name, creating it on first use.
+    //
+    static const BobAtom* intern(const std::string& name);
+
+    const std::string& name() const
+    {
+        return m_name;
+    }
+
+private:
+    BobAtom(const std::string& name)
+        : m_name(name)
+    {}
+
+    BobAtom(const BobAtom&);
+    BobAtom& operator=(const BobAtom&);
+
+    std::string m_name;
+};
+
+#endif /* ATOM_H */
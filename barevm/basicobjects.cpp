@@ -6,7 +6,6 @@
 //*****************************************************************************
 #include "basicobjects.h"
 #include "utils.h"
-#include <typeinfo>
 #include <cassert>
 
 using namespace std;
@@ -14,6 +13,9 @@ using namespace std;
 
 // ----------- BobNull ------------
 //
+BobNull BobNull::the_null;
+
+
 bool BobNull::equals_to(const BobObject& other) const
 {
     (void)other;
@@ -32,6 +34,10 @@ string BobNull::repr() const
 
 // ----------- BobBoolean ------------
 //
+BobBoolean BobBoolean::the_true(true);
+BobBoolean BobBoolean::the_false(false);
+
+
 bool BobBoolean::equals_to(const BobObject& other) const
 {
     const BobBoolean& other_num = static_cast<const BobBoolean&>(other);
@@ -71,7 +77,7 @@ bool BobSymbol::equals_to(const BobObject& other) const
 
 string BobSymbol::repr() const
 {
-    return m_value;
+    return m_value.str();
 }
 
 
@@ -92,33 +98,33 @@ string BobPair::repr() const
 }
 
 
-void BobPair::gc_mark_pointed()
+void BobPair::gc_visit_pointed(BobObjectVisitor& visitor)
 {
-    m_first->gc_mark();
-    m_second->gc_mark();
+    visitor.visit(m_first);
+    visitor.visit(m_second);
 }
 
 
 std::string BobPair::repr_internal() const
 {
     assert(m_first && "Expect valid pointer in m_first");
-    string rep = m_first->repr();
+    string rep = object_repr(m_first);
 
     // Linearizes a nested pair structure. I.e:
     // Pair(1, Pair(2, Null)) ==> 1 2
     // The loop runs until the current pair's m_second is no longer a pair.
     //
     const BobPair* pair = this;
-    while (const BobPair* second_pair = dynamic_cast<const BobPair*>(pair->m_second)) {
+    while (const BobPair* second_pair = object_cast<BobPair>(pair->m_second)) {
         assert(second_pair->m_first && "Expect valid pointer in m_first");
-        rep += " " + second_pair->m_first->repr();
+        rep += " " + object_repr(second_pair->m_first);
         pair = second_pair;
     }
     assert(pair->m_second && "Expect valid pointer in m_second");
 
-    if (typeid(*pair->m_second) == typeid(BobNull))
+    if (object_cast<BobNull>(pair->m_second))
         return rep;
     else
-        return rep + " . " + pair->m_second->repr();
+        return rep + " . " + object_repr(pair->m_second);
 }
 
@@ -8,33 +8,56 @@
 #define BASICOBJECTS_H
 
 #include "bobobject.h"
+#include "utils.h"
 #include <string>
+#include <cassert>
 
 
 // A Scheme "null" - empty list
 //
+// There's a single, immortal null object: get() returns it. It has static
+// storage, so it's not known to the GC, and nulls can be compared by
+// pointer.
+//
 class BobNull : public BobObject
 {
 public:
-    BobNull()
-    {}
+    static const BobType type_tag = TYPE_NULL;
+
+    static BobNull* get()
+    {
+        return &the_null;
+    }
 
     ~BobNull()
     {}
 
     std::string repr() const;
     bool equals_to(const BobObject& other) const;
+
+private:
+    static BobNull the_null;
+
+    BobNull()
+        : BobObject(type_tag, true)
+    {}
 };
 
 
 // A Scheme boolean - true or false
 //
+// Like the null object, the two boolean objects are immortal singletons
+// returned by get().
+//
 class BobBoolean : public BobObject
 {
 public:
-    BobBoolean(bool value)
-        : m_value(value)
-    {}
+    static const BobType type_tag = TYPE_BOOLEAN;
+
+    static BobBoolean* get(bool value)
+    {
+        return value ? &the_true : &the_false;
+    }
 
     ~BobBoolean()
     {}
@@ -44,17 +67,29 @@ public:
     bool equals_to(const BobObject& other) const;
 
 private:
+    static BobBoolean the_true;
+    static BobBoolean the_false;
+
+    BobBoolean(bool value)
+        : BobObject(type_tag, true), m_value(value)
+    {}
+
     bool m_value;
 };
 
 
-// A Scheme number - integer
+// A Scheme number - integer. Numbers are represented by fixnums (see
+// bobobject.h) whenever the value fits, which is all int values on 64-bit
+// platforms. BobNumber objects box the values that don't fit. Use the
+// functions below instead of accessing either representation directly.
 //
 class BobNumber : public BobObject
 {
 public:
+    static const BobType type_tag = TYPE_NUMBER;
+
     BobNumber(int value)
-        : m_value(value)
+        : BobObject(type_tag), m_value(value)
     {}
 
     ~BobNumber()
@@ -68,13 +103,66 @@ private:
 };
 
 
-// A Scheme symbol - a constant string
+// Create a number with the given value
+//
+inline BobObject* make_number(int value)
+{
+    if (fits_fixnum(value))
+        return make_fixnum(value);
+    else
+        return new BobNumber(value);
+}
+
+inline bool is_number(const BobObject* obj)
+{
+    return is_fixnum(obj) || obj->type() == TYPE_NUMBER;
+}
+
+// The value of a number. obj must be a number (is_number). Fixnums are only
+// made by make_number, so their values always fit an int.
+//
+inline int number_value(const BobObject* obj)
+{
+    if (is_fixnum(obj)) {
+        assert(fixnum_value(obj) == static_cast<int>(fixnum_value(obj)));
+        return static_cast<int>(fixnum_value(obj));
+    }
+    else {
+        return as<BobNumber>(obj)->value();
+    }
+}
+
+
+// Arithmetic on the values of numbers. Numbers are 32-bit, and a result
+// that doesn't fit wraps around as in two's complement, instead of being
+// a signed overflow, which is undefined behavior in C++.
+//
+inline int add_numbers(int a, int b)
+{
+    return static_cast<int>(static_cast<unsigned>(a) + static_cast<unsigned>(b));
+}
+
+inline int sub_numbers(int a, int b)
+{
+    return static_cast<int>(static_cast<unsigned>(a) - static_cast<unsigned>(b));
+}
+
+inline int mul_numbers(int a, int b)
+{
+    return static_cast<int>(static_cast<unsigned>(a) * static_cast<unsigned>(b));
+}
+
+
+// A Scheme symbol - a constant string. The text isn't copied: it's usually
+// in the bytecode file the symbol was loaded from.
 //
 class BobSymbol : public BobObject
 {
 public:
-    BobSymbol(const std::string& value)
-        : m_value(value)
+    static const BobType type_tag = TYPE_SYMBOL;
+
+    BobSymbol(const StringRef& value)
+        : BobObject(type_tag), m_value(value)
     {}
 
     ~BobSymbol()
@@ -83,7 +171,7 @@ public:
     std::string repr() const;
     bool equals_to(const BobObject& other) const;
 private:
-    std::string m_value;
+    StringRef m_value;
 };
 
 
@@ -92,8 +180,10 @@ private:
 class BobPair : public BobObject
 {
 public:
+    static const BobType type_tag = TYPE_PAIR;
+
     BobPair(BobObject* first, BobObject* second)
-        : m_first(first), m_second(second)
+        : BobObject(type_tag), m_first(first), m_second(second)
     {}
 
     ~BobPair()
@@ -101,13 +191,21 @@ public:
 
     BobObject* first() {return m_first;}
     BobObject* second() {return m_second;}
-    void set_first(BobObject* first) {m_first = first;}
-    void set_second(BobObject* second) {m_second = second;}
+    void set_first(BobObject* first)
+    {
+        gc_write_barrier(first);
+        m_first = first;
+    }
+    void set_second(BobObject* second)
+    {
+        gc_write_barrier(second);
+        m_second = second;
+    }
 
     std::string repr() const;
     bool equals_to(const BobObject& other) const;
 
-    virtual void gc_mark_pointed();
+    virtual void gc_visit_pointed(BobObjectVisitor& visitor);
 
 private:
     std::string repr_internal() const;
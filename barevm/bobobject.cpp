@@ -8,15 +8,51 @@
 #include "builtins.h"
 #include "utils.h"
 #include "vm.h"
-#include <typeinfo>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <utility>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
 
 using namespace std;
 
-BobObject::BobObject()
-    : m_gc_marked(false)
+// When built with AddressSanitizer, free cells are poisoned, so that any
+// access to an object the GC collected is reported.
+//
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define POISON_CELL(p, size) ASAN_POISON_MEMORY_REGION((p), (size))
+#define UNPOISON_CELL(p, size) ASAN_UNPOISON_MEMORY_REGION((p), (size))
+#else
+#define POISON_CELL(p, size) ((void)(p), (void)(size))
+#define UNPOISON_CELL(p, size) ((void)(p), (void)(size))
+#endif
+
+const char *type_name(BobType type)
+{
+    static const char *names[NUM_TYPES] = {
+        "null", "boolean", "number", "symbol", "pair", "builtin",
+        "closure", "codeobject", "environment", "frame", "forwarded"};
+    return type < NUM_TYPES ? names[type] : "unknown";
+}
+
+BobObject::BobObject(BobType type)
+    : m_type(static_cast<unsigned char>(type)),
+      m_immortal(BobAllocator::get().allocating_permanent()),
+      m_gc_old(m_immortal), m_gc_remembered(false)
+{
+}
+
+BobObject::BobObject(BobType type, bool immortal)
+    : m_type(static_cast<unsigned char>(type)), m_immortal(immortal),
+      m_gc_old(false), m_gc_remembered(false)
 {
 }
 
@@ -26,14 +62,27 @@ BobObject::~BobObject()
 
 bool objects_equal(const BobObject *lhs, const BobObject *rhs)
 {
+    // Numbers that fit in a fixnum are never boxed, so a fixnum is only
+    // equal to an identical fixnum.
+    //
     if (lhs == rhs)
         return true;
-    else if (typeid(*lhs) != typeid(*rhs))
+    else if (is_fixnum(lhs) || is_fixnum(rhs))
+        return false;
+    else if (lhs->type() != rhs->type())
         return false;
     else
         return lhs->equals_to(*rhs);
 }
 
+string object_repr(const BobObject *obj)
+{
+    if (is_fixnum(obj))
+        return value_to_string(fixnum_value(obj));
+    else
+        return obj->repr();
+}
+
 void *BobObject::operator new(size_t sz)
 {
     return BobAllocator::get().allocate_object(sz);
@@ -48,25 +97,771 @@ void BobObject::operator delete(void *p)
 //
 BobAllocator BobAllocator::the_allocator;
 
+// Heap layout
+//
+// Objects are allocated in pages of PAGE_SIZE bytes, aligned to PAGE_SIZE,
+// so the page holding an object is found by masking its address. A page
+// starts with a PageHeader, followed by cells of equal size.
+//
+// Objects of up to MAX_SMALL_SIZE bytes are rounded up to a multiple of
+// GRANULE and allocated in pages dedicated to their size class: first from
+// the free list of the class, and then by bumping through the class's
+// current page. Each larger object gets a page of its own, with a single
+// cell, whose size is whatever the object needs.
+//
+// Each page has two bitmaps with a bit per cell: the allocated bits tell
+// which cells hold objects, and the mark bits are set by the GC's mark
+// phase. Sweeping a page goes over the bitmaps a word at a time, destroying
+// the allocated objects that weren't marked.
+//
+// Small pages are swept lazily. A collection only counts the dead objects
+// of each page from its bitmaps, and queues the page to be swept by its
+// size class. When the free list of a size class runs out, the allocator
+// sweeps the next queued page of the class, and takes its free cells.
+// Pages left unswept when the next collection starts are swept then, since
+// marking changes the bits that tell which of their objects are dead.
+//
+// Mark bits are "sticky": they're only cleared when a major collection
+// starts, so between major collections the marked objects are exactly the
+// old generation, and a minor collection's marking stops at them. Objects
+// aren't moved when they're promoted.
+//
+// Marking doesn't recurse. Marked objects are pushed on a mark stack, and
+// their pointers are marked as they're popped off. Popping the most
+// recently pushed object first traces the heap depth-first, which tends to
+// follow allocation order, and so page order; the object at the top of the
+// stack is prefetched while the one before it is scanned.
+//
+// Stop-the-world collections can mark in parallel (see set_mark_threads).
+// Each marking thread has a private stack, and a deque from which the other
+// threads steal work when theirs runs out. Mark bits are then set with
+// atomic operations, so that each object is pushed by one thread only.
+//
+// A compacting major collection (see set_compacting) copies the live
+// movable objects as it traces them, each to a fresh cell of its size
+// class, and leaves a BobForwarded in the old cell. The copies are marked,
+// and so are the pinned objects it reaches, so the mark bits tell which
+// objects were already visited; pointers to forwarded objects are updated
+// as they're visited. The forwarders themselves are unmarked, so sweeping
+// disposes of them like of any dead object.
+//
+// Incremental marking is tri-color: unmarked objects are white, marked
+// objects on the mark stack are gray, and marked objects whose pointers
+// were marked are black. The program may store a pointer to a white object
+// into a black one between marking steps; the write barrier then pushes
+// the black object back on the mark stack. Objects allocated while
+// marking start out white, and the roots aren't covered by the barrier, so
+// the final pause marks the roots again before sweeping.
+//
+namespace
+{
+const size_t PAGE_SIZE = 64 * 1024;
+const size_t GRANULE = 16;
+const size_t MAX_SMALL_SIZE = 256;
+const size_t NUM_SIZE_CLASSES = MAX_SMALL_SIZE / GRANULE;
+const size_t LARGE_SIZE_CLASS = NUM_SIZE_CLASSES;
+const size_t BITS_PER_WORD = 64;
+const size_t BITMAP_WORDS = PAGE_SIZE / GRANULE / BITS_PER_WORD;
+
+// Keep at most this many empty pages around for reuse, instead of
+// returning them to the system.
+//
+const size_t MAX_EMPTY_PAGES = 256;
+
+// Incremental marking checks its time budget after scanning each batch of
+// this many objects.
+//
+const size_t MARK_BATCH = 16;
+
+// Collections of smaller heaps than this are marked by a single thread even
+// when more are configured; waking the threads up would take longer.
+//
+const size_t PARALLEL_MARK_MIN_SIZE = 1024 * 1024;
+
+// A marking thread shares half of its private stack once it holds more than
+// this many objects, if its deque is empty.
+//
+const size_t MARK_SHARE_SIZE = 64;
+
+// The permanent space is allocated in chunks of this size (or of the size
+// of a larger object)
+//
+const size_t PERMANENT_CHUNK_SIZE = 256 * 1024;
+
+// The most the GC time ratio may multiply the threshold by
+//
+const unsigned MAX_THRESHOLD_BOOST = 64;
+
+inline size_t round_up(size_t n, size_t to)
+{
+    return (n + to - 1) / to * to;
+}
+
+struct PageHeader
+{
+    size_t size_class;
+    size_t cell_size;
+    size_t num_cells;
+
+    // Cells [0, bump) have been handed out since the page was created
+    //
+    size_t bump;
+
+    // The position of a small page in the allocator's pages
+    //
+    size_t index;
+
+    uint64_t allocated_bits[BITMAP_WORDS];
+    uint64_t mark_bits[BITMAP_WORDS];
+
+    char *cells()
+    {
+        return reinterpret_cast<char *>(this) + HEADER_SIZE;
+    }
+
+    void *cell(size_t index)
+    {
+        return cells() + index * cell_size;
+    }
+
+    size_t cell_index(const void *p)
+    {
+        return (static_cast<const char *>(p) - cells()) / cell_size;
+    }
+
+    static PageHeader *of(const void *p)
+    {
+        return reinterpret_cast<PageHeader *>(
+            reinterpret_cast<uintptr_t>(p) & ~static_cast<uintptr_t>(PAGE_SIZE - 1));
+    }
+
+    static const size_t HEADER_SIZE;
+};
+
+const size_t PageHeader::HEADER_SIZE = round_up(sizeof(PageHeader), GRANULE);
+
+inline bool test_bit(const uint64_t *bitmap, size_t index)
+{
+    return (bitmap[index / BITS_PER_WORD] >> (index % BITS_PER_WORD)) & 1;
+}
+
+inline void set_bit(uint64_t *bitmap, size_t index)
+{
+    bitmap[index / BITS_PER_WORD] |= static_cast<uint64_t>(1) << (index % BITS_PER_WORD);
+}
+
+inline void clear_bit(uint64_t *bitmap, size_t index)
+{
+    bitmap[index / BITS_PER_WORD] &= ~(static_cast<uint64_t>(1) << (index % BITS_PER_WORD));
+}
+
+// Index of the lowest set bit in a non-zero word
+//
+inline size_t lowest_bit(uint64_t word)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#else
+    size_t bit = 0;
+    while (!(word & 1))
+    {
+        word >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+inline size_t popcount(uint64_t word)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(word);
+#else
+    size_t count = 0;
+    for (; word; word &= word - 1)
+        ++count;
+    return count;
+#endif
+}
+
+// Set the bit, and return true if it wasn't set before. Safe to call from
+// several threads at once.
+//
+inline bool atomic_set_bit(uint64_t *bitmap, size_t index)
+{
+    uint64_t *word = &bitmap[index / BITS_PER_WORD];
+    uint64_t bit = static_cast<uint64_t>(1) << (index % BITS_PER_WORD);
+#if defined(__GNUC__)
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+        return false;
+    return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+#else
+    atomic<uint64_t> *atomic_word = reinterpret_cast<atomic<uint64_t> *>(word);
+    if (atomic_word->load(memory_order_relaxed) & bit)
+        return false;
+    return !(atomic_word->fetch_or(bit, memory_order_relaxed) & bit);
+#endif
+}
+
+inline void prefetch(const void *p)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(p);
+#else
+    (void)p;
+#endif
+}
+
+// A free cell holds the link to the next free cell of its size class
+//
+struct FreeCell
+{
+    FreeCell *next;
+};
+
+// The state of a thread taking part in a parallel marking
+//
+struct MarkWorker
+{
+    // Objects to scan, only accessed by the owning thread
+    //
+    vector<BobObject *> stack;
+
+    // Objects to scan that other threads may steal
+    //
+    mutex shared_lock;
+    deque<BobObject *> shared;
+    atomic<size_t> num_shared;
+
+    MarkWorker()
+        : num_shared(0)
+    {
+    }
+};
+
+// The worker of the marking thread this is called in, or 0 if the thread
+// isn't marking in parallel
+//
+thread_local MarkWorker *current_mark_worker = 0;
+
+// Left by a compacting collection in the cell of an object it moved
+//
+class BobForwarded : public BobObject
+{
+public:
+    static const BobType type_tag = TYPE_FORWARDED;
+
+    explicit BobForwarded(BobObject *target)
+        : BobObject(type_tag), target(target)
+    {
+    }
+
+    BobObject *target;
+};
+
+// Can a compacting collection move the object? Only objects that may be
+// copied bit by bit, and whose cells can hold a BobForwarded, are moved.
+//
+inline bool is_movable(const BobObject *obj, const PageHeader *page)
+{
+    switch (obj->type())
+    {
+    case TYPE_PAIR:
+    case TYPE_CLOSURE:
+    case TYPE_FRAME:
+        return page->size_class != LARGE_SIZE_CLASS && page->cell_size >= sizeof(BobForwarded);
+    default:
+        return false;
+    }
+}
+
+} // namespace
+
 // The implementation details of the allocator
 //
-typedef pair<BobObject *, size_t> LiveObject;
 struct BobAllocator::Impl
 {
-    list<LiveObject> live_objects;
+    // Pages of the small size classes, and pages of large objects
+    //
+    vector<PageHeader *> pages;
+    vector<PageHeader *> large_pages;
+
+    // Empty pages kept for reuse by any size class
+    //
+    vector<PageHeader *> empty_pages;
+
+    FreeCell *free_lists[NUM_SIZE_CLASSES];
+    PageHeader *current_pages[NUM_SIZE_CLASSES];
+
+    // Small pages waiting to be swept, by size class, and the number and
+    // total size of the dead objects in them
+    //
+    vector<PageHeader *> unswept[NUM_SIZE_CLASSES];
+    size_t unswept_objects;
+    size_t unswept_size;
+
+    // Old objects that may point to young ones (see gc_write_barrier)
+    //
+    vector<BobObject *> remembered;
+
+    // The variables rooted by BobRoots
+    //
+    vector<BobObject **> roots;
+
+    // The permanent space: the chunks its objects are allocated from (the
+    // last one up to permanent_chunk_used), the number and total size of
+    // its objects, and the permanent objects that may point into the heap
+    //
+    vector<char *> permanent_chunks;
+    size_t permanent_chunk_used;
+    size_t permanent_objects;
+    size_t permanent_size;
+    vector<BobObject *> permanent_remembered;
+
+    // Marked objects whose pointers are yet to be marked
+    //
+    vector<BobObject *> mark_stack;
+
+    // Is an incremental marking under way?
+    //
+    bool marking;
+
+    // Are major collections compacting?
+    //
+    bool compacting;
+
+    // Parallel marking: the number of marking threads (including the one
+    // running the collection), a worker for each, and the threads other
+    // than the collecting one, which wait for a new mark_generation between
+    // markings. active_workers counts the workers that may still find or
+    // make work.
+    //
+    size_t num_mark_threads;
+    vector<MarkWorker *> mark_workers;
+    vector<thread> mark_threads;
+    mutex mark_threads_lock;
+    condition_variable mark_start_cond, mark_done_cond;
+    unsigned mark_generation;
+    size_t num_marking_threads;
+    bool mark_threads_stop;
+    atomic<size_t> active_workers;
+
+    size_t num_live_objects;
     size_t total_alloc_size;
+
+    // The heap growth policy (see set_size_threshold), the threshold it
+    // set after the last collection, and the factor the GC time ratio
+    // multiplies it by
+    //
+    size_t min_threshold;
+    size_t max_threshold;
+    double heap_growth;
+    double gc_time_ratio;
+    size_t threshold;
+    unsigned threshold_boost;
+
+    // The time spent collecting since the end of the last collection (by
+    // incremental marking steps), and when that was
+    //
+    chrono::steady_clock::duration gc_time;
+    chrono::steady_clock::time_point last_collection_end;
+
+    // The total size of the old generation, now and right after the last
+    // major collection
+    //
+    size_t old_size;
+    size_t old_size_at_major;
+
+    // Incremental marking: the pause budget (0 to stop the world), the
+    // total allocation size when the marking started and at its last
+    // step, and the number of steps so far
+    //
+    unsigned pause_budget_us;
+    size_t size_at_marking_start;
+    size_t size_at_step;
+    size_t num_steps;
+
     bool debug_on;
 
     BobVM *vm_obj;
 
     Impl()
-        : total_alloc_size(0), debug_on(false), vm_obj(0)
+        : unswept_objects(0), unswept_size(0),
+          permanent_chunk_used(0), permanent_objects(0), permanent_size(0),
+          marking(false), compacting(false), num_mark_threads(1), mark_generation(0), num_marking_threads(0),
+          mark_threads_stop(false), active_workers(0),
+          num_live_objects(0), total_alloc_size(0), min_threshold(10 * 1024 * 1024),
+          max_threshold(0), heap_growth(2), gc_time_ratio(0), threshold(min_threshold),
+          threshold_boost(1), gc_time(chrono::steady_clock::duration::zero()),
+          last_collection_end(chrono::steady_clock::now()), old_size(0),
+          old_size_at_major(0), pause_budget_us(0), size_at_marking_start(0), size_at_step(0),
+          num_steps(0),
+          debug_on(false), vm_obj(0)
+    {
+        for (size_t i = 0; i < NUM_SIZE_CLASSES; ++i)
+        {
+            free_lists[i] = 0;
+            current_pages[i] = 0;
+        }
+    }
+
+    ~Impl()
+    {
+        stop_mark_threads();
+    }
+
+    PageHeader *new_page(size_t size_class, size_t cell_size, size_t page_size);
+    void free_page(PageHeader *page);
+    void add_page(PageHeader *page);
+    void remove_page(PageHeader *page);
+    void *allocate_small(size_t size_class);
+    void *allocate_large(size_t sz);
+    void *allocate_permanent(size_t sz);
+    bool sweep_page(PageHeader *page);
+    void sweep_small_page(PageHeader *page);
+    void add_free_cells(PageHeader *page);
+    void start_sweep();
+    void finish_sweep();
+    void visit_roots(BobObjectVisitor &visitor);
+    void forget_remembered(bool mark_pointed);
+    void clear_mark_bits();
+    bool drain_mark_stack(BobObjectVisitor &visitor, const chrono::steady_clock::time_point *deadline);
+    void mark_all();
+    BobObject *evacuate(BobObject *obj);
+    void compact();
+    void mark_in_parallel();
+    void start_mark_threads();
+    void stop_mark_threads();
+    void mark_thread_main(size_t index);
+    void run_mark_worker(size_t index);
+    bool take_mark_work(size_t index);
+    void collect(bool major);
+    void update_threshold(chrono::steady_clock::time_point start);
+    void resize_threshold();
+    void report(const char *kind, size_t old_num_live_objects, size_t old_total_alloc_size) const;
+
+    size_t live_objects() const
+    {
+        return num_live_objects - unswept_objects;
+    }
+
+    size_t live_size() const
+    {
+        return total_alloc_size - unswept_size;
+    }
+
+    // Has the size class run out of free cells and of room in its current
+    // page?
+    //
+    bool out_of_cells(size_t size_class) const
     {
+        PageHeader *page = current_pages[size_class];
+        return !free_lists[size_class] && (!page || page->bump == page->num_cells);
     }
+
+    template <class Visitor>
+    void for_each_object(Visitor &visitor) const;
+
+    // Marks the objects whose pointers it visits: sets their mark bits,
+    // and pushes the ones that weren't marked before on the mark stack (or
+    // on the marking thread's stack, in a parallel marking). Mark bits of
+    // old objects stay set between major collections, so minor collections
+    // don't go into the old generation.
+    //
+    struct Marker : BobObjectVisitor
+    {
+        Impl *heap;
+
+        explicit Marker(Impl *heap)
+            : heap(heap)
+        {
+        }
+
+        void visit_object(BobObject *&obj)
+        {
+            PageHeader *page = PageHeader::of(obj);
+            size_t index = page->cell_index(obj);
+            if (MarkWorker *worker = current_mark_worker)
+            {
+                if (atomic_set_bit(page->mark_bits, index))
+                {
+                    obj->m_gc_old = true;
+                    worker->stack.push_back(obj);
+                }
+            }
+            else if (!test_bit(page->mark_bits, index))
+            {
+                set_bit(page->mark_bits, index);
+                obj->m_gc_old = true;
+                heap->mark_stack.push_back(obj);
+            }
+        }
+    };
+
+    // Moves the objects whose pointers it visits, in a compacting
+    // collection
+    //
+    struct Evacuator : BobObjectVisitor
+    {
+        Impl *heap;
+
+        explicit Evacuator(Impl *heap)
+            : heap(heap)
+        {
+        }
+
+        void visit_object(BobObject *&obj)
+        {
+            obj = heap->evacuate(obj);
+        }
+    };
 };
 
+PageHeader *BobAllocator::Impl::new_page(size_t size_class, size_t cell_size, size_t page_size)
+{
+    void *mem = 0;
+    if (page_size == PAGE_SIZE && !empty_pages.empty())
+    {
+        mem = empty_pages.back();
+        empty_pages.pop_back();
+        UNPOISON_CELL(mem, PAGE_SIZE);
+    }
+    else if (posix_memalign(&mem, PAGE_SIZE, page_size) != 0)
+        throw bad_alloc();
+
+    PageHeader *page = static_cast<PageHeader *>(mem);
+    page->size_class = size_class;
+    page->cell_size = cell_size;
+    page->num_cells = size_class == LARGE_SIZE_CLASS ? 1 : (PAGE_SIZE - PageHeader::HEADER_SIZE) / cell_size;
+    page->bump = 0;
+    memset(page->allocated_bits, 0, sizeof(page->allocated_bits));
+    memset(page->mark_bits, 0, sizeof(page->mark_bits));
+    return page;
+}
+
+void BobAllocator::Impl::free_page(PageHeader *page)
+{
+    UNPOISON_CELL(page, PageHeader::HEADER_SIZE + page->num_cells * page->cell_size);
+    // The program will allocate up to the threshold before the next
+    // collection, so that many pages are worth keeping. Compacting
+    // collections copy the live objects to empty pages, so about as many
+    // as the heap has in use are worth keeping then too.
+    size_t max_empty_pages = max(MAX_EMPTY_PAGES, threshold / PAGE_SIZE);
+    if (compacting)
+        max_empty_pages = max(max_empty_pages, pages.size());
+    if (page->size_class != LARGE_SIZE_CLASS && empty_pages.size() < max_empty_pages)
+        empty_pages.push_back(page);
+    else
+        free(page);
+}
+
+void BobAllocator::Impl::add_page(PageHeader *page)
+{
+    page->index = pages.size();
+    pages.push_back(page);
+}
+
+void BobAllocator::Impl::remove_page(PageHeader *page)
+{
+    PageHeader *last = pages.back();
+    pages[page->index] = last;
+    last->index = page->index;
+    pages.pop_back();
+}
+
+void *BobAllocator::Impl::allocate_small(size_t size_class)
+{
+    while (!free_lists[size_class] && !unswept[size_class].empty())
+    {
+        PageHeader *page = unswept[size_class].back();
+        unswept[size_class].pop_back();
+        sweep_small_page(page);
+    }
+
+    if (FreeCell *cell = free_lists[size_class])
+    {
+        PageHeader *page = PageHeader::of(cell);
+        UNPOISON_CELL(cell, page->cell_size);
+        free_lists[size_class] = cell->next;
+        set_bit(page->allocated_bits, page->cell_index(cell));
+        return cell;
+    }
+
+    PageHeader *page = current_pages[size_class];
+    if (!page || page->bump == page->num_cells)
+    {
+        page = new_page(size_class, (size_class + 1) * GRANULE, PAGE_SIZE);
+        add_page(page);
+        current_pages[size_class] = page;
+    }
+    set_bit(page->allocated_bits, page->bump);
+    return page->cell(page->bump++);
+}
+
+void *BobAllocator::Impl::allocate_large(size_t sz)
+{
+    PageHeader *page = new_page(LARGE_SIZE_CLASS, sz, PageHeader::HEADER_SIZE + sz);
+    large_pages.push_back(page);
+    page->bump = 1;
+    set_bit(page->allocated_bits, 0);
+    return page->cell(0);
+}
+
+void *BobAllocator::Impl::allocate_permanent(size_t sz)
+{
+    sz = round_up(sz, GRANULE);
+    if (permanent_chunks.empty() || permanent_chunk_used + sz > PERMANENT_CHUNK_SIZE)
+    {
+        void *mem = 0;
+        if (posix_memalign(&mem, GRANULE, max(sz, PERMANENT_CHUNK_SIZE)) != 0)
+            throw bad_alloc();
+        permanent_chunks.push_back(static_cast<char *>(mem));
+        permanent_chunk_used = 0;
+    }
+    void *p = permanent_chunks.back() + permanent_chunk_used;
+    permanent_chunk_used += sz;
+    ++permanent_objects;
+    permanent_size += sz;
+    return p;
+}
+
+// Destroy the unmarked objects in the page. Return true if the page has no
+// objects left.
+//
+bool BobAllocator::Impl::sweep_page(PageHeader *page)
+{
+    bool empty = true;
+    size_t num_words = (page->bump + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    for (size_t w = 0; w < num_words; ++w)
+    {
+        uint64_t dead = page->allocated_bits[w] & ~page->mark_bits[w];
+        while (dead)
+        {
+            size_t bit = lowest_bit(dead);
+            dead &= dead - 1;
+            BobObject *obj = static_cast<BobObject *>(page->cell(w * BITS_PER_WORD + bit));
+            total_alloc_size -= page->cell_size;
+            --num_live_objects;
+            obj->~BobObject(); // garbage!!
+            POISON_CELL(obj, page->cell_size);
+        }
+        page->allocated_bits[w] &= page->mark_bits[w];
+        if (page->allocated_bits[w])
+            empty = false;
+    }
+    return empty;
+}
+
+// Sweep a queued small page, and add its free cells to the free list of
+// its size class, or release it if it's left empty.
+//
+void BobAllocator::Impl::sweep_small_page(PageHeader *page)
+{
+    size_t old_num_live_objects = num_live_objects;
+    size_t old_total_alloc_size = total_alloc_size;
+    if (sweep_page(page))
+    {
+        remove_page(page);
+        free_page(page);
+    }
+    else
+        add_free_cells(page);
+    unswept_objects -= old_num_live_objects - num_live_objects;
+    unswept_size -= old_total_alloc_size - total_alloc_size;
+}
+
+// Thread all the free cells of the page into the free list of its size
+// class, in address order. The page's cells are all handed out after that.
+//
+void BobAllocator::Impl::add_free_cells(PageHeader *page)
+{
+    FreeCell *&head = free_lists[page->size_class];
+    for (size_t i = page->num_cells; i-- > 0;)
+    {
+        if (!test_bit(page->allocated_bits, i))
+        {
+            FreeCell *cell = static_cast<FreeCell *>(page->cell(i));
+            UNPOISON_CELL(cell, page->cell_size);
+            cell->next = head;
+            head = cell;
+            POISON_CELL(cell, page->cell_size);
+        }
+    }
+    page->bump = page->num_cells;
+}
+
+// Called when marking is done: queue all the small pages to be swept, and
+// sweep the large pages.
+//
+void BobAllocator::Impl::start_sweep()
+{
+    unswept_objects = 0;
+    unswept_size = 0;
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; ++i)
+    {
+        free_lists[i] = 0;
+        current_pages[i] = 0;
+    }
+
+    for (size_t i = pages.size(); i-- > 0;)
+    {
+        PageHeader *page = pages[i];
+        size_t num_dead = 0;
+        size_t num_words = (page->bump + BITS_PER_WORD - 1) / BITS_PER_WORD;
+        for (size_t w = 0; w < num_words; ++w)
+            num_dead += popcount(page->allocated_bits[w] & ~page->mark_bits[w]);
+        unswept_objects += num_dead;
+        unswept_size += num_dead * page->cell_size;
+        unswept[page->size_class].push_back(page);
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < large_pages.size(); ++i)
+    {
+        PageHeader *page = large_pages[i];
+        if (sweep_page(page))
+            free_page(page);
+        else
+            large_pages[kept++] = page;
+    }
+    large_pages.resize(kept);
+}
+
+// Sweep all the queued pages
+//
+void BobAllocator::Impl::finish_sweep()
+{
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; ++i)
+    {
+        while (!unswept[i].empty())
+        {
+            PageHeader *page = unswept[i].back();
+            unswept[i].pop_back();
+            sweep_small_page(page);
+        }
+    }
+}
+
+template <class Visitor>
+void BobAllocator::Impl::for_each_object(Visitor &visitor) const
+{
+    const vector<PageHeader *> *lists[] = {&pages, &large_pages};
+    for (size_t l = 0; l < 2; ++l)
+    {
+        for (vector<PageHeader *>::const_iterator it = lists[l]->begin(); it != lists[l]->end(); ++it)
+        {
+            PageHeader *page = *it;
+            for (size_t i = 0; i < page->bump; ++i)
+            {
+                if (test_bit(page->allocated_bits, i))
+                    visitor(static_cast<BobObject *>(page->cell(i)), page->cell_size);
+            }
+        }
+    }
+}
+
 BobAllocator::BobAllocator()
-    : d(new BobAllocator::Impl)
+    : d(new BobAllocator::Impl), m_collection_pending(false), m_permanent(false)
 {
 }
 
@@ -77,16 +872,81 @@ BobAllocator::~BobAllocator()
 
 void *BobAllocator::allocate_object(size_t sz)
 {
-    void *mem = ::operator new(sz);
-    LiveObject liveobject = make_pair(static_cast<BobObject *>(mem), sz);
-    d->live_objects.push_back(liveobject);
-    d->total_alloc_size += sz;
+    if (m_permanent)
+        return d->allocate_permanent(sz);
+
+    void *mem;
+    if (sz <= MAX_SMALL_SIZE)
+    {
+        size_t size_class = (sz + GRANULE - 1) / GRANULE - 1;
+        if (d->out_of_cells(size_class))
+            collect_if_needed();
+        mem = d->allocate_small(size_class);
+        d->total_alloc_size += (size_class + 1) * GRANULE;
+    }
+    else
+    {
+        sz = round_up(sz, GRANULE);
+        collect_if_needed();
+        mem = d->allocate_large(sz);
+        d->total_alloc_size += sz;
+    }
+    ++d->num_live_objects;
     return mem;
 }
 
+// Called when an object is deleted explicitly (like when its constructor
+// throws), rather than collected.
+//
 void BobAllocator::release_object(void *p)
 {
-    ::operator delete(p);
+    // The permanent space is never reclaimed. The object was allocated by
+    // the same new expression, so in the same scope.
+    if (m_permanent)
+        return;
+
+    PageHeader *page = PageHeader::of(p);
+    d->total_alloc_size -= page->cell_size;
+    --d->num_live_objects;
+
+    if (page->size_class == LARGE_SIZE_CLASS)
+    {
+        d->large_pages.erase(find(d->large_pages.begin(), d->large_pages.end(), page));
+        d->free_page(page);
+    }
+    else
+    {
+        clear_bit(page->allocated_bits, page->cell_index(p));
+        clear_bit(page->mark_bits, page->cell_index(p));
+        FreeCell *cell = static_cast<FreeCell *>(p);
+        cell->next = d->free_lists[page->size_class];
+        d->free_lists[page->size_class] = cell;
+        POISON_CELL(cell, page->cell_size);
+    }
+}
+
+void BobAllocator::remember(BobObject *obj)
+{
+    // Permanent objects aren't marked, so one pointing into the heap has
+    // its pointers visited as roots from now on.
+    if (obj->m_immortal)
+    {
+        d->permanent_remembered.push_back(obj);
+        return;
+    }
+
+    // While marking incrementally, a marked object may already have had
+    // its pointers marked, so it goes back on the mark stack. An unmarked
+    // one will have them marked when it's marked itself, if it is.
+    if (d->marking)
+    {
+        if (test_bit(PageHeader::of(obj)->mark_bits, PageHeader::of(obj)->cell_index(obj)))
+            d->mark_stack.push_back(obj);
+        else
+            obj->m_gc_remembered = false;
+        return;
+    }
+    d->remembered.push_back(obj);
 }
 
 void BobAllocator::register_vm_obj(BobVM *vm_obj)
@@ -94,75 +954,584 @@ void BobAllocator::register_vm_obj(BobVM *vm_obj)
     d->vm_obj = vm_obj;
 }
 
+void BobAllocator::set_size_threshold(size_t min_threshold, size_t max_threshold)
+{
+    d->min_threshold = min_threshold;
+    d->max_threshold = max_threshold;
+    d->resize_threshold();
+}
+
+void BobAllocator::set_heap_growth(double heap_growth)
+{
+    d->heap_growth = max(heap_growth, 1.0);
+    d->resize_threshold();
+}
+
+void BobAllocator::set_gc_time_ratio(double ratio)
+{
+    d->gc_time_ratio = ratio;
+    d->threshold_boost = 1;
+    d->resize_threshold();
+}
+
+void BobAllocator::set_pause_budget(unsigned budget_us)
+{
+    d->pause_budget_us = budget_us;
+}
+
+void BobAllocator::set_mark_threads(unsigned num_threads)
+{
+    d->stop_mark_threads();
+    d->num_mark_threads = max(num_threads, 1u);
+}
+
+void BobAllocator::set_compacting(bool compacting)
+{
+    d->compacting = compacting;
+}
+
 void BobAllocator::set_debugging(bool debug_on)
 {
     d->debug_on = debug_on;
 }
 
+// The statistics only count live objects, so the heap is swept first.
+//
 string BobAllocator::stats_general() const
 {
+    d->finish_sweep();
     string s = "========================================\n";
-    s += format_string("Number of live objects: %u\n", d->live_objects.size());
+    s += format_string("Number of live objects: %u\n", d->num_live_objects);
     s += format_string("Total allocation size: %u\n", d->total_alloc_size);
+    s += format_string("Old generation size: %u\n", d->old_size);
+    s += format_string("Pages: %u small, %u large, %u empty\n",
+                       d->pages.size(), d->large_pages.size(), d->empty_pages.size());
+    s += format_string("Permanent space: %u objects (total size %u)\n",
+                       d->permanent_objects, d->permanent_size);
+    s += format_string("Remembered permanent objects: %u\n",
+                       d->permanent_remembered.size());
     return s;
 }
 
-string BobAllocator::stats_all_live() const
+namespace
+{
+struct LiveObjectPrinter
 {
-    string s = "==== Live objects ====\n";
-    for (list<LiveObject>::const_iterator it = d->live_objects.begin();
-         it != d->live_objects.end(); ++it)
+    string s;
+
+    void operator()(BobObject *obj, size_t size)
     {
-        BobObject *obj = it->first;
-        size_t size = it->second;
-        if (dynamic_cast<BobBuiltinProcedure *>(obj) == 0)
+        if (!is<BobBuiltinProcedure>(obj))
             s += format_string("%s(%u) %s\n",
-                               typeid(*obj).name(), size, obj->repr().c_str());
+                               type_name(obj->type()), size, obj->repr().c_str());
     }
-    return s;
+};
+} // namespace
+
+string BobAllocator::stats_all_live() const
+{
+    d->finish_sweep();
+    LiveObjectPrinter printer;
+    printer.s = "==== Live objects ====\n";
+    d->for_each_object(printer);
+    return printer.s;
 }
 
-void BobAllocator::run_gc(size_t size_threshold)
+// Called by allocations (before they take a cell), when a collection may
+// be due
+//
+void BobAllocator::collect_if_needed()
 {
-    if (d->total_alloc_size <= size_threshold)
+    if (!d->vm_obj || m_collection_pending)
+        return;
+
+    if (d->marking)
+    {
+        if (d->total_alloc_size > d->size_at_step + d->threshold / 8)
+            mark_step();
+        return;
+    }
+
+    if (d->live_size() - d->old_size <= d->threshold)
         return;
 
-    size_t old_num_live_objects = d->live_objects.size();
+    bool major = d->old_size > d->heap_growth * max(d->old_size_at_major, d->min_threshold);
+    if (major && d->compacting)
+        m_collection_pending = true;
+    else if (major && d->pause_budget_us > 0)
+        start_marking();
+    else
+        d->collect(major);
+}
+
+void BobAllocator::run_pending_collection()
+{
+    m_collection_pending = false;
+    d->collect(true);
+}
+
+void BobAllocator::run_full_gc()
+{
+    m_collection_pending = false;
+    if (d->marking)
+        finish_marking(chrono::steady_clock::now());
+    d->collect(true);
+    d->finish_sweep();
+}
+
+void BobAllocator::start_marking()
+{
+    d->finish_sweep();
+    d->forget_remembered(false);
+    d->clear_mark_bits();
+    d->size_at_marking_start = d->total_alloc_size;
+    d->num_steps = 0;
+
+    d->marking = true;
+    Impl::Marker marker(d);
+    d->visit_roots(marker);
+    mark_step();
+}
+
+void BobAllocator::mark_step()
+{
+    d->size_at_step = d->total_alloc_size;
+    ++d->num_steps;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    // If the program allocates faster than the steps mark, the heap keeps
+    // growing. Once it has doubled, the rest is marked in one go.
+    if (d->total_alloc_size > 2 * max(d->size_at_marking_start, d->threshold))
+    {
+        finish_marking(start);
+        return;
+    }
+
+    chrono::steady_clock::time_point deadline = start + chrono::microseconds(d->pause_budget_us);
+    Impl::Marker marker(d);
+    if (d->drain_mark_stack(marker, &deadline))
+        finish_marking(start);
+    else
+        d->gc_time += chrono::steady_clock::now() - start;
+}
+
+// Called by the step that started at start, when nothing is left to mark
+//
+void BobAllocator::finish_marking(chrono::steady_clock::time_point start)
+{
+    // The roots may have changed since they were marked at the start, and
+    // objects allocated since are unmarked.
+    Impl::Marker marker(d);
+    d->visit_roots(marker);
+    d->mark_all();
+    d->marking = false;
+
+    size_t old_num_live_objects = d->num_live_objects;
     size_t old_total_alloc_size = d->total_alloc_size;
+    d->start_sweep();
+    d->old_size = d->old_size_at_major = d->live_size();
+    d->update_threshold(start);
+
+    d->report(format_string("incremental major collection, %u steps", d->num_steps).c_str(),
+              old_num_live_objects, old_total_alloc_size);
+}
 
-    // * Mark each object found in the roots. Marking as implemented by
-    //   BobObject's subclasses is recursive.
-    d->vm_obj->gc_mark_roots();
+void BobAllocator::push_root(BobObject **slot)
+{
+    d->roots.push_back(slot);
+}
 
-    // * Sweep phase: go over all the live objects
-    //   * Marked objects are used and thus have to keep living. Clear their
-    //     mark flag.
-    //   * Unmarked objects aren't used and can be deleted.
-    list<LiveObject>::iterator it = d->live_objects.begin();
-    while (it != d->live_objects.end())
+void BobAllocator::pop_root()
+{
+    d->roots.pop_back();
+}
+
+// Pass the VM's roots, the rooted variables and the pointers of the
+// remembered permanent objects to the visitor
+//
+void BobAllocator::Impl::visit_roots(BobObjectVisitor &visitor)
+{
+    vm_obj->gc_visit_roots(visitor);
+    for (vector<BobObject **>::iterator it = roots.begin(); it != roots.end(); ++it)
+    {
+        if (**it)
+            visitor.visit(**it);
+    }
+    for (vector<BobObject *>::iterator it = permanent_remembered.begin();
+         it != permanent_remembered.end(); ++it)
+        (*it)->gc_visit_pointed(visitor);
+}
+
+// Clear the remembered set. For a minor collection, the objects pointed to
+// by the remembered objects are marked first.
+//
+void BobAllocator::Impl::forget_remembered(bool mark_pointed)
+{
+    Marker marker(this);
+    for (vector<BobObject *>::iterator it = remembered.begin(); it != remembered.end(); ++it)
+    {
+        (*it)->m_gc_remembered = false;
+        if (mark_pointed)
+            (*it)->gc_visit_pointed(marker);
+    }
+    remembered.clear();
+}
+
+void BobAllocator::Impl::clear_mark_bits()
+{
+    for (size_t i = 0; i < pages.size(); ++i)
+        memset(pages[i]->mark_bits, 0, sizeof(pages[i]->mark_bits));
+    for (size_t i = 0; i < large_pages.size(); ++i)
+        memset(large_pages[i]->mark_bits, 0, sizeof(large_pages[i]->mark_bits));
+}
+
+// Pop objects off the mark stack and pass their pointers to the visitor,
+// until the mark stack is empty or the deadline (if given) has passed.
+// Return true if the mark stack is empty.
+//
+bool BobAllocator::Impl::drain_mark_stack(BobObjectVisitor &visitor,
+                                          const chrono::steady_clock::time_point *deadline)
+{
+    size_t num_scanned = 0;
+    while (!mark_stack.empty())
+    {
+        BobObject *obj = mark_stack.back();
+        mark_stack.pop_back();
+
+        // The next object to scan is fetched while this one is scanned
+        if (!mark_stack.empty())
+            prefetch(mark_stack.back());
+
+        obj->m_gc_remembered = false;
+        obj->gc_visit_pointed(visitor);
+
+        if (deadline && ++num_scanned % MARK_BATCH == 0 &&
+            chrono::steady_clock::now() >= *deadline)
+            break;
+    }
+    return mark_stack.empty();
+}
+
+// Empty the mark stack, with all the marking threads if the heap is big
+// enough.
+//
+void BobAllocator::Impl::mark_all()
+{
+    if (num_mark_threads > 1 && total_alloc_size >= PARALLEL_MARK_MIN_SIZE)
+        mark_in_parallel();
+    else
+    {
+        Marker marker(this);
+        drain_mark_stack(marker, 0);
+    }
+}
+
+// Return the location of the object after the compacting collection: move
+// it there if it's movable and wasn't visited before, and mark it.
+//
+BobObject *BobAllocator::Impl::evacuate(BobObject *obj)
+{
+    if (obj->type() == TYPE_FORWARDED)
+        return static_cast<BobForwarded *>(obj)->target;
+
+    PageHeader *page = PageHeader::of(obj);
+    size_t index = page->cell_index(obj);
+    if (test_bit(page->mark_bits, index))
+        return obj;
+
+    if (!is_movable(obj, page))
+    {
+        set_bit(page->mark_bits, index);
+        obj->m_gc_old = true;
+        mark_stack.push_back(obj);
+        return obj;
+    }
+
+    void *mem = allocate_small(page->size_class);
+    memcpy(mem, static_cast<const void *>(obj), page->cell_size);
+    total_alloc_size += page->cell_size;
+    ++num_live_objects;
+
+    BobObject *copy = static_cast<BobObject *>(mem);
+    PageHeader *copy_page = PageHeader::of(copy);
+    set_bit(copy_page->mark_bits, copy_page->cell_index(copy));
+    copy->m_gc_old = true;
+    ::new (static_cast<void *>(obj)) BobForwarded(copy);
+    mark_stack.push_back(copy);
+    return copy;
+}
+
+// Trace the heap from the roots, moving the movable objects. The pointers
+// of each object are visited right after it's moved, so the objects it
+// points to are copied next to it.
+//
+void BobAllocator::Impl::compact()
+{
+    // The copies must go to fresh cells, not to free cells among the
+    // objects being moved.
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; ++i)
+    {
+        free_lists[i] = 0;
+        current_pages[i] = 0;
+    }
+
+    Evacuator evacuator(this);
+    visit_roots(evacuator);
+    drain_mark_stack(evacuator, 0);
+}
+
+// The objects on the mark stack are dealt out to the workers, and the
+// collecting thread marks along with the others until no worker has
+// anything left.
+//
+void BobAllocator::Impl::mark_in_parallel()
+{
+    if (mark_threads.empty())
+        start_mark_threads();
+
+    for (size_t i = 0; i < mark_stack.size(); ++i)
+        mark_workers[i % num_mark_threads]->stack.push_back(mark_stack[i]);
+    mark_stack.clear();
+    active_workers = num_mark_threads;
+
+    {
+        lock_guard<mutex> lock(mark_threads_lock);
+        ++mark_generation;
+        num_marking_threads = mark_threads.size();
+    }
+    mark_start_cond.notify_all();
+
+    run_mark_worker(0);
+
+    unique_lock<mutex> lock(mark_threads_lock);
+    while (num_marking_threads > 0)
+        mark_done_cond.wait(lock);
+}
+
+void BobAllocator::Impl::start_mark_threads()
+{
+    for (size_t i = 0; i < num_mark_threads; ++i)
+        mark_workers.push_back(new MarkWorker);
+    mark_threads_stop = false;
+    for (size_t i = 1; i < num_mark_threads; ++i)
+        mark_threads.push_back(thread(&Impl::mark_thread_main, this, i));
+}
+
+void BobAllocator::Impl::stop_mark_threads()
+{
+    {
+        lock_guard<mutex> lock(mark_threads_lock);
+        mark_threads_stop = true;
+    }
+    mark_start_cond.notify_all();
+    for (size_t i = 0; i < mark_threads.size(); ++i)
+        mark_threads[i].join();
+    mark_threads.clear();
+
+    for (size_t i = 0; i < mark_workers.size(); ++i)
+        delete mark_workers[i];
+    mark_workers.clear();
+}
+
+void BobAllocator::Impl::mark_thread_main(size_t index)
+{
+    unsigned generation = 0;
+    for (;;)
     {
-        BobObject *obj = it->first;
-        size_t size = it->second;
-        if (obj->is_gc_marked())
         {
-            obj->gc_clear();
-            ++it;
+            unique_lock<mutex> lock(mark_threads_lock);
+            while (!mark_threads_stop && mark_generation == generation)
+                mark_start_cond.wait(lock);
+            if (mark_threads_stop)
+                return;
+            generation = mark_generation;
         }
-        else
+
+        run_mark_worker(index);
+
+        lock_guard<mutex> lock(mark_threads_lock);
+        if (--num_marking_threads == 0)
+            mark_done_cond.notify_one();
+    }
+}
+
+// Scan objects from the worker's stack, then from its deque, then from the
+// other workers' deques. A worker that finds nothing becomes inactive
+// until another worker shares work; marking is done when all workers are
+// inactive, since only active workers push objects.
+//
+void BobAllocator::Impl::run_mark_worker(size_t index)
+{
+    MarkWorker *worker = mark_workers[index];
+    current_mark_worker = worker;
+    Marker marker(this);
+
+    for (;;)
+    {
+        vector<BobObject *> &stack = worker->stack;
+        while (!stack.empty())
+        {
+            BobObject *obj = stack.back();
+            stack.pop_back();
+            if (!stack.empty())
+                prefetch(stack.back());
+
+            obj->m_gc_remembered = false;
+            obj->gc_visit_pointed(marker);
+
+            if (stack.size() > MARK_SHARE_SIZE && worker->num_shared == 0)
+            {
+                // The bottom of the stack holds the objects pushed first,
+                // which have the most left to trace below them.
+                size_t half = stack.size() / 2;
+                lock_guard<mutex> lock(worker->shared_lock);
+                worker->shared.insert(worker->shared.end(), stack.begin(), stack.begin() + half);
+                worker->num_shared = worker->shared.size();
+                stack.erase(stack.begin(), stack.begin() + half);
+            }
+        }
+
+        if (take_mark_work(index))
+            continue;
+
+        --active_workers;
+        for (;;)
         {
-            it = d->live_objects.erase(it);
-            delete obj; // garbage!!
-            d->total_alloc_size -= size;
+            if (active_workers == 0)
+            {
+                current_mark_worker = 0;
+                return;
+            }
+
+            bool any_shared = false;
+            for (size_t i = 0; i < mark_workers.size(); ++i)
+                any_shared = any_shared || mark_workers[i]->num_shared > 0;
+            if (any_shared)
+            {
+                ++active_workers;
+                if (take_mark_work(index))
+                    break;
+                --active_workers;
+            }
+            this_thread::yield();
         }
     }
+}
 
-    // Debugging...
-    if (d->debug_on && d->total_alloc_size != old_total_alloc_size)
+// Move work into the worker's stack: all of its own deque, or else half of
+// another worker's. Return false if there was none.
+//
+bool BobAllocator::Impl::take_mark_work(size_t index)
+{
+    for (size_t n = 0; n < mark_workers.size(); ++n)
     {
-        cerr << "=== GC collection\n";
+        MarkWorker *victim = mark_workers[(index + n) % mark_workers.size()];
+        if (victim->num_shared == 0)
+            continue;
+
+        lock_guard<mutex> lock(victim->shared_lock);
+        size_t count = n == 0 ? victim->shared.size() : (victim->shared.size() + 1) / 2;
+        if (count == 0)
+            continue;
+        vector<BobObject *> &stack = mark_workers[index]->stack;
+        stack.insert(stack.end(), victim->shared.begin(), victim->shared.begin() + count);
+        victim->shared.erase(victim->shared.begin(), victim->shared.begin() + count);
+        victim->num_shared = victim->shared.size();
+        return true;
+    }
+    return false;
+}
+
+void BobAllocator::Impl::collect(bool major)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    finish_sweep();
+    size_t old_num_live_objects = num_live_objects;
+    size_t old_total_alloc_size = total_alloc_size;
+
+    // * A major collection starts with no objects marked and nothing
+    //   remembered: the whole heap is traced from the roots.
+    //   A minor collection traces from the roots, and from the objects
+    //   pointed to by the remembered old objects. Marking stops at old
+    //   objects, whose mark bits are still set.
+    forget_remembered(!major);
+    if (major)
+        clear_mark_bits();
+
+    // * Mark each object found in the roots, and everything reachable from
+    //   them through the mark stack. Marking sets the mark bits in the
+    //   objects' pages. Marked objects become old. A compacting collection
+    //   moves the movable objects while it marks.
+    bool compacting_now = major && compacting;
+    if (compacting_now)
+        compact();
+    else
+    {
+        Marker marker(this);
+        visit_roots(marker);
+        mark_all();
+    }
+
+    // * Sweep phase: go over the pages
+    //   * Marked objects are used and thus have to keep living.
+    //   * Unmarked objects aren't used and are destroyed; their cells go
+    //     back to the free lists. Pages left empty are released.
+    //   Small pages are only queued here, and swept as the program
+    //   allocates.
+    start_sweep();
+
+    // Everything that survived is old now
+    old_size = live_size();
+    if (major)
+        old_size_at_major = old_size;
+    update_threshold(start);
+
+    const char *kind = compacting_now ? "compacting major collection"
+                       : major        ? "major collection"
+                                      : "minor collection";
+    report(kind, old_num_live_objects, old_total_alloc_size);
+}
+
+// Called at the end of a collection that started at start: set the
+// threshold for the next collection from the size of the heap that
+// survived, and from the time spent collecting.
+//
+void BobAllocator::Impl::update_threshold(chrono::steady_clock::time_point start)
+{
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    gc_time += now - start;
+    if (gc_time_ratio > 0)
+    {
+        double ratio = chrono::duration<double>(gc_time).count() /
+                       max(chrono::duration<double>(now - last_collection_end).count(), 1e-9);
+        if (ratio > gc_time_ratio && threshold_boost < MAX_THRESHOLD_BOOST)
+            threshold_boost *= 2;
+        else if (ratio < gc_time_ratio / 2 && threshold_boost > 1)
+            threshold_boost /= 2;
+    }
+    gc_time = chrono::steady_clock::duration::zero();
+    last_collection_end = now;
+    resize_threshold();
+}
+
+void BobAllocator::Impl::resize_threshold()
+{
+    double target = (heap_growth - 1) * live_size() * threshold_boost;
+    if (max_threshold && target > max_threshold)
+        target = max_threshold;
+    threshold = max(static_cast<size_t>(target), min_threshold);
+}
+
+void BobAllocator::Impl::report(const char *kind, size_t old_num_live_objects,
+                                size_t old_total_alloc_size) const
+{
+    if (debug_on && live_size() != old_total_alloc_size)
+    {
+        cerr << "=== GC " << kind << "\n";
         cerr << format_string("--> was %u objects (total size %u)\n",
                               old_num_live_objects, old_total_alloc_size);
         cerr << format_string("--> now %u objects (total size %u)\n",
-                              d->live_objects.size(), d->total_alloc_size);
+                              live_objects(), live_size());
     }
 }
+
@@ -10,19 +10,86 @@
 #include <string>
 #include <list>
 #include <vector>
+#include <stdint.h>
+#include <cassert>
+#include <chrono>
+
+// The concrete type of a BobObject, stored in its header. Each class
+// deriving from BobObject declares its tag as a static type_tag member and
+// passes it to the BobObject constructor. Classes further derived from
+// those (like the VM's own builtins) share their base's tag.
+//
+enum BobType
+{
+    TYPE_NULL,
+    TYPE_BOOLEAN,
+    TYPE_NUMBER,
+    TYPE_SYMBOL,
+    TYPE_PAIR,
+    TYPE_BUILTIN_PROCEDURE,
+    TYPE_CLOSURE,
+    TYPE_CODE_OBJECT,
+    TYPE_ENVIRONMENT,
+    TYPE_FRAME,
+    TYPE_FORWARDED,
+    NUM_TYPES
+};
+
+// A printable name of the type, for debugging
+//
+const char *type_name(BobType type);
+
+class BobObject;
+
+// Visits the pointers held by objects and by the VM roots. The pointers are
+// passed by reference, so that a moving collection can update them to the
+// new locations of the objects they point to.
+//
+class BobObjectVisitor
+{
+public:
+    virtual ~BobObjectVisitor()
+    {
+    }
+
+    // Fixnums and immortal objects are never marked nor moved, so they
+    // aren't passed on to visit_object.
+    //
+    inline void visit(BobObject *&obj);
+
+    template <class T>
+    void visit(T *&obj)
+    {
+        BobObject *p = obj;
+        visit(p);
+        obj = static_cast<T *>(p);
+    }
+
+protected:
+    virtual void visit_object(BobObject *&obj) = 0;
+};
+
 
 // Abstract base class for all objects managed by the Bob VM.
 //
 // Objects deriving from BobObject are automatically garbage-collected.
 // Therefore, you should only allocate them dynamically with new, and
-// never, *ever* explicitly delete them.
+// never, *ever* explicitly delete them. The only exceptions are immortal
+// singletons with static storage (like the null and boolean objects), which
+// the GC never sees as allocated and so never collects. Objects allocated
+// while a BobPermanentScope is active are immortal too.
 //
 class BobObject
 {
 public:
-    BobObject();
+    explicit BobObject(BobType type);
     virtual ~BobObject() = 0;
 
+    BobType type() const
+    {
+        return static_cast<BobType>(m_type);
+    }
+
     virtual std::string repr() const
     {
         return "<object>";
@@ -42,39 +109,51 @@ public:
     void *operator new(size_t sz);
     void operator delete(void *p);
 
-    // Mark this object and its pointed-to objects as live. Subclasses are
-    // expected to implement gc_mark_pointed() to mark their own pointers.
+    // Immortal objects are never collected: they're either static
+    // singletons, or objects in the allocator's permanent space.
     //
-    virtual void gc_mark()
+    bool is_immortal() const
     {
-        // Only recurse if not already marked; this prevents infinite recursion.
-        if (!m_gc_marked)
-        {
-            m_gc_marked = true;
-            gc_mark_pointed();
-        }
+        return m_immortal;
     }
 
-    virtual void gc_clear()
+    // Objects that survived a collection belong to the old generation.
+    //
+    bool is_old() const
     {
-        m_gc_marked = false;
+        return m_gc_old;
     }
 
-    virtual bool is_gc_marked() const
-    {
-        return m_gc_marked;
-    }
+    // The write barrier of the GC. Every method that stores a pointer into
+    // an existing object must call it with the stored value, so that an old
+    // object pointing to young ones is remembered, and a marked object is
+    // marked again by incremental marking. Pointers to immortal objects,
+    // which are never collected nor moved, don't need to be remembered.
+    //
+    inline void gc_write_barrier(const BobObject *value);
 
 protected:
-    bool m_gc_marked;
+    // For immortal singletons with static storage
+    //
+    BobObject(BobType type, bool immortal);
 
-    // Mark all objects pointed to by this object as live.
-    // The default implementation does nothing here, to simplify the trivial
+    unsigned char m_type;
+    bool m_immortal;
+    bool m_gc_old;
+    bool m_gc_remembered;
+
+    // Pass all pointers to other objects this object holds to the visitor.
+    // This is how the GC finds the objects reachable from a live object:
+    // subclasses holding pointers are expected to implement it. The
+    // default implementation does nothing here, to simplify the trivial
     // objects that hold no pointers to other objects
     //
-    virtual void gc_mark_pointed()
+    virtual void gc_visit_pointed(BobObjectVisitor &visitor)
     {
+        (void)visitor;
     }
+
+    friend class BobAllocator;
 };
 
 class BobVM;
@@ -92,20 +171,102 @@ public:
     void *allocate_object(std::size_t sz);
     void release_object(void *p);
 
-    // Run the garbage collector if the total allocation size is larger
-    // than size_threshold.
+    // The GC is generational: objects surviving a collection are old, and
+    // are only collected by major collections, which go over the whole
+    // heap. Minor collections only mark and collect young objects, starting
+    // from the roots and from the old objects in the remembered set, which
+    // may point to young objects.
+    //
+    // Collections are triggered by allocation: when a size class runs out
+    // of free cells and of room in its current page, or a large object is
+    // allocated, the garbage collector runs if more bytes than its
+    // threshold were allocated since the previous collection. The
+    // collection is major if the old generation has grown by the heap
+    // growth factor since the previous major collection (and has outgrown
+    // min_threshold), minor otherwise.
+    //
+    // The threshold follows the size of the heap. After each collection,
+    // it's set to let the heap grow to heap_growth times the size of the
+    // objects that survived, but no less than min_threshold, and no more
+    // than max_threshold (unless it's 0). The defaults are a min_threshold
+    // of 10MB, no max_threshold and a heap_growth of 2.
+    //
+    // Collections only run while a VM is registered. Code that allocates
+    // while it holds the only pointer to an object in a local variable
+    // must keep the object alive with a BobRoot.
+    //
+    void set_size_threshold(size_t min_threshold, size_t max_threshold = 0);
+    void set_heap_growth(double heap_growth);
+
+    // With a non-zero ratio, the threshold is also adapted to the time the
+    // GC takes: it's doubled (up to 64 times what the heap growth asks
+    // for) after each collection that finds that collecting took more than
+    // this fraction of the time since the previous collection, and halved
+    // back when it took less than half of it. 0 (the default) disables it.
+    //
+    void set_gc_time_ratio(double ratio);
+
+    // Compacting collections (see set_compacting) move objects, which
+    // would leave stale pointers in the locals of the code allocating. So
+    // an allocation only requests them, and they run at the next
+    // safepoint: a point where the VM holds no objects outside its roots.
+    //
+    void safepoint()
+    {
+        if (m_collection_pending)
+            run_pending_collection();
+    }
+
+    // Run a major collection right away
+    //
+    void run_full_gc();
+
+    // With a non-zero pause budget, major collections mark incrementally:
+    // allocation marks for up to budget_us microseconds at a time, whenever
+    // an eighth of the threshold was allocated since the previous step, and
+    // lets the program run in between. Once nothing is left to mark, the
+    // roots are marked again and the heap is swept in a final pause. Minor
+    // collections don't run while marking is under way. With a zero
+    // budget (the default) major collections stop the world.
     //
-    void run_gc(size_t size_threshold);
+    void set_pause_budget(unsigned budget_us);
+
+    // Mark with num_threads threads in stop-the-world collections (and in
+    // the final pause of incremental ones) of heaps bigger than 1MB. The
+    // default is 1.
+    //
+    void set_mark_threads(unsigned num_threads);
+
+    // Make major collections compacting: instead of being marked in
+    // place, the live pairs, closures and frames are copied to fresh pages
+    // in the order they're traced, so that lists and environment chains end
+    // up contiguous. Other objects (and objects too large for the small
+    // size classes) are pinned, and are marked as usual. Compacting
+    // collections stop the world and run on a single thread, regardless of
+    // the pause budget and the number of marking threads. Off by default.
+    //
+    void set_compacting(bool compacting);
+
+    // Add an old object to the remembered set (see gc_write_barrier)
+    //
+    void remember(BobObject *obj);
 
     // Set debugging state of the GC
     //
     void set_debugging(bool debug_on);
 
-    // Register a VM object with the GC. The VM object is used to
-    // mark the roots.
+    // Register a VM object with the GC (or 0 to unregister it). The VM
+    // object is used to mark the roots.
     //
     void register_vm_obj(BobVM *vm_obj);
 
+    // Is a BobPermanentScope active?
+    //
+    bool allocating_permanent() const
+    {
+        return m_permanent;
+    }
+
     // Return various statistics as a string for debugging
     //
     std::string stats_general() const;
@@ -120,12 +281,176 @@ private:
     BobAllocator(const BobAllocator &);
     BobAllocator &operator=(const BobAllocator &);
 
+    void collect_if_needed();
+    void run_pending_collection();
+
+    // Incremental marking (see set_pause_budget)
+    //
+    void start_marking();
+    void mark_step();
+    void finish_marking(std::chrono::steady_clock::time_point start);
+
+    // The root stack (see BobRoot)
+    //
+    void push_root(BobObject **slot);
+    void pop_root();
+
     struct Impl;
     BobAllocator::Impl *d;
+    bool m_collection_pending;
+    bool m_permanent;
+
+    friend class BobRoot;
+    friend class BobPermanentScope;
+};
+
+// Keeps the object a local BobObject* variable points to alive while a
+// collection may run, until the BobRoot goes out of scope. The variable is
+// pushed on the allocator's root stack, so BobRoots must be destroyed in
+// the reverse order of their creation, which locals are.
+//
+class BobRoot
+{
+public:
+    explicit BobRoot(BobObject *&slot)
+    {
+        BobAllocator::get().push_root(&slot);
+    }
+
+    ~BobRoot()
+    {
+        BobAllocator::get().pop_root();
+    }
+
+private:
+    BobRoot(const BobRoot &);
+    BobRoot &operator=(const BobRoot &);
+};
+
+// While a BobPermanentScope is active, objects are allocated in the
+// allocator's permanent space. They're meant for objects created when a
+// program is loaded (code objects, their constants, builtins), which live
+// as long as the program runs anyway: permanent objects are never
+// collected, and aren't marked nor scanned by collections. The objects
+// they point to must be permanent or immortal too, unless stored with the
+// write barrier, which remembers a permanent object for good once it
+// points into the heap; the GC then visits its pointers as roots.
+//
+class BobPermanentScope
+{
+public:
+    BobPermanentScope()
+        : m_was_permanent(BobAllocator::get().m_permanent)
+    {
+        BobAllocator::get().m_permanent = true;
+    }
+
+    ~BobPermanentScope()
+    {
+        BobAllocator::get().m_permanent = m_was_permanent;
+    }
+
+private:
+    BobPermanentScope(const BobPermanentScope &);
+    BobPermanentScope &operator=(const BobPermanentScope &);
+
+    bool m_was_permanent;
 };
 
 // Compare two objects of any type derived from BobObject
 //
 bool objects_equal(const BobObject *, const BobObject *);
 
+
+// Small integers ("fixnums") aren't allocated as objects; they're encoded in
+// the BobObject* itself, shifted left by one bit with the lowest bit set.
+// Objects are always at least 2-byte aligned, so real object pointers have
+// this bit clear.
+//
+// A BobObject* that may hold a number must be checked with is_fixnum before
+// it's dereferenced. The helpers below do this for the common operations.
+// The numeric interface itself (make_number etc.) is in basicobjects.h.
+//
+inline bool is_fixnum(const BobObject *obj)
+{
+    return (reinterpret_cast<uintptr_t>(obj) & 1) != 0;
+}
+
+inline BobObject *make_fixnum(intptr_t value)
+{
+    return reinterpret_cast<BobObject *>((static_cast<uintptr_t>(value) << 1) | 1);
+}
+
+inline intptr_t fixnum_value(const BobObject *obj)
+{
+    return reinterpret_cast<intptr_t>(obj) >> 1;
+}
+
+// Can value be represented as a fixnum?
+//
+inline bool fits_fixnum(intptr_t value)
+{
+    return fixnum_value(make_fixnum(value)) == value;
+}
+
+// Is obj an object of class T? This checks the type tag, so it's false for
+// fixnums even when T is BobNumber; use is_number for numbers.
+//
+template <class T>
+inline bool is(const BobObject *obj)
+{
+    return !is_fixnum(obj) && obj->type() == T::type_tag;
+}
+
+// Cast obj, which must be an object of class T, to T*.
+//
+template <class T>
+inline T *as(BobObject *obj)
+{
+    assert(is<T>(obj) && "Bad object type in as<T>");
+    return static_cast<T *>(obj);
+}
+
+template <class T>
+inline const T *as(const BobObject *obj)
+{
+    assert(is<T>(obj) && "Bad object type in as<T>");
+    return static_cast<const T *>(obj);
+}
+
+// Cast obj to T* if it's an object of class T, return 0 otherwise.
+//
+template <class T>
+inline T *object_cast(BobObject *obj)
+{
+    return is<T>(obj) ? static_cast<T *>(obj) : 0;
+}
+
+template <class T>
+inline const T *object_cast(const BobObject *obj)
+{
+    return is<T>(obj) ? static_cast<const T *>(obj) : 0;
+}
+
+inline void BobObjectVisitor::visit(BobObject *&obj)
+{
+    if (!is_fixnum(obj) && !obj->is_immortal())
+        visit_object(obj);
+}
+
+inline void BobObject::gc_write_barrier(const BobObject *value)
+{
+    // Storing 0 (an unbound value), a fixnum or an immortal object can't
+    // make an old object point into the young generation.
+    if (m_gc_old && !m_gc_remembered && value && !is_fixnum(value) && !value->m_immortal)
+    {
+        m_gc_remembered = true;
+        BobAllocator::get().remember(this);
+    }
+}
+
+// The representation of obj as returned by BobObject::repr, for fixnums too.
+//
+std::string object_repr(const BobObject *obj);
+
 #endif /* BOBOBJECT_H */
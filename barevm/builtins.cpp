@@ -23,53 +23,54 @@ static inline void builtin_verify(bool condition, const string& message)
 }
 
 
-static inline void verify_numargs(BuiltinArgs& args, size_t num, const string& name)
-{
-    builtin_verify(args.size() == num, format_string("%s expects %u arguments", name.c_str(), num));
-}
-
-
 // Try to dynamically case arg to T* and return the cast pointer. On failure,
 // throw BuiltinError with message as the error.
 //
 template <class T>
 static inline T* verify_argtype(BobObject* arg, string message)
 {
-    T* arg_t = dynamic_cast<T*>(arg);
+    T* arg_t = object_cast<T>(arg);
     if (!arg_t)
         throw BuiltinError(message);
     return arg_t;
 }
 
 
-static BobObject* car(BuiltinArgs& args)
+// Return the value of a numeric arg. If it's not a number, throw
+// BuiltinError with message as the error.
+//
+static inline int verify_number(BobObject* arg, string message)
+{
+    if (!is_number(arg))
+        throw BuiltinError(message);
+    return number_value(arg);
+}
+
+
+static BobObject* car(const BuiltinArgs& args)
 {
-    verify_numargs(args, 1, "car");
     BobPair* pair = verify_argtype<BobPair>(args[0], "car expects a pair");
     return pair->first();
 }
 
 
-static BobObject* cdr(BuiltinArgs& args)
+static BobObject* cdr(const BuiltinArgs& args)
 {
-    verify_numargs(args, 1, "cdr");
     BobPair* pair = verify_argtype<BobPair>(args[0], "cdr expects a pair");
     return pair->second();
 }
 
 
-static BobObject* cadr(BuiltinArgs& args)
+static BobObject* cadr(const BuiltinArgs& args)
 {
-    verify_numargs(args, 1, "cadr");
     BobPair* pair = verify_argtype<BobPair>(args[0], "cadr expects a pair");
     BobPair* cdr_pair = verify_argtype<BobPair>(pair->second(), "cadr expects arg's cdr to be a pair");
     return cdr_pair->first();
 }
 
 
-static BobObject* caddr(BuiltinArgs& args)
+static BobObject* caddr(const BuiltinArgs& args)
 {
-    verify_numargs(args, 1, "caddr");
     BobPair* pair = verify_argtype<BobPair>(args[0], "caddr expects a pair");
     BobPair* cdr_pair = verify_argtype<BobPair>(pair->second(), "caddr expects arg's cdr to be a pair");
     BobPair* cddr_pair = verify_argtype<BobPair>(cdr_pair->second(), "caddr expects arg's cddr to be a pair");
@@ -77,27 +78,24 @@ static BobObject* caddr(BuiltinArgs& args)
 }
 
 
-static BobObject* set_car(BuiltinArgs& args)
+static BobObject* set_car(const BuiltinArgs& args)
 {
-    verify_numargs(args, 2, "set-car");
     BobPair* pair = verify_argtype<BobPair>(args[0], "set-car expects a pair");
     pair->set_first(args[1]);
-    return new BobNull();
+    return BobNull::get();
 }
 
 
-static BobObject* set_cdr(BuiltinArgs& args)
+static BobObject* set_cdr(const BuiltinArgs& args)
 {
-    verify_numargs(args, 2, "set-cdr");
     BobPair* pair = verify_argtype<BobPair>(args[0], "set-cdr expects a pair");
     pair->set_second(args[1]);
-    return new BobNull();
+    return BobNull::get();
 }
 
 
-static BobObject* cons(BuiltinArgs& args)
+static BobObject* cons(const BuiltinArgs& args)
 {
-    verify_numargs(args, 2, "cons");
     //cerr << "==== Before GC In cons\n" << BobAllocator::get().stats_all_live() << endl;
     //cerr << "====== Running GC ======\n";
     //BobAllocator::get().run_gc();
@@ -106,10 +104,10 @@ static BobObject* cons(BuiltinArgs& args)
 }
 
 
-static BobObject* builtin_list(BuiltinArgs& args)
+static BobObject* builtin_list(const BuiltinArgs& args)
 {
-    BobObject* lst = new BobNull();
-    vector<BobObject*> vv;
+    BobObject* lst = BobNull::get();
+    BobRoot lst_root(lst);
 
     typedef reverse_iterator<BuiltinArgsIterator> BuiltinArgsRevereIterator;
     BuiltinArgsRevereIterator rev_begin(args.end());
@@ -123,89 +121,76 @@ static BobObject* builtin_list(BuiltinArgs& args)
 }
 
 
-static BobObject* pair_p(BuiltinArgs& args)
+static BobObject* pair_p(const BuiltinArgs& args)
 {
-    verify_numargs(args, 1, "pair?");
-    BobPair* pair = dynamic_cast<BobPair*>(args[0]);
-    return new BobBoolean(pair != 0);
+    BobPair* pair = object_cast<BobPair>(args[0]);
+    return BobBoolean::get(pair != 0);
 }
 
 
-static BobObject* boolean_p(BuiltinArgs& args)
+static BobObject* boolean_p(const BuiltinArgs& args)
 {
-    verify_numargs(args, 1, "boolean?");
-    BobBoolean* boolean = dynamic_cast<BobBoolean*>(args[0]);
-    return new BobBoolean(boolean != 0);
+    return BobBoolean::get(args[0] == BobBoolean::get(true) || args[0] == BobBoolean::get(false));
 }
 
 
-static BobObject* symbol_p(BuiltinArgs& args)
+static BobObject* symbol_p(const BuiltinArgs& args)
 {
-    verify_numargs(args, 1, "symbol?");
-    BobSymbol* sym = dynamic_cast<BobSymbol*>(args[0]);
-    return new BobBoolean(sym != 0);
+    BobSymbol* sym = object_cast<BobSymbol>(args[0]);
+    return BobBoolean::get(sym != 0);
 }
 
 
-static BobObject* number_p(BuiltinArgs& args)
+static BobObject* number_p(const BuiltinArgs& args)
 {
-    verify_numargs(args, 1, "number?");
-    BobNumber* num = dynamic_cast<BobNumber*>(args[0]);
-    return new BobBoolean(num != 0);
+    return BobBoolean::get(is_number(args[0]));
 }
 
 
-static BobObject* null_p(BuiltinArgs& args)
+static BobObject* null_p(const BuiltinArgs& args)
 {
-    verify_numargs(args, 1, "null?");
-    BobNull* null = dynamic_cast<BobNull*>(args[0]);
-    return new BobBoolean(null != 0);
+    return BobBoolean::get(args[0] == BobNull::get());
 }
 
 
-static BobObject* zero_p(BuiltinArgs& args)
+static BobObject* zero_p(const BuiltinArgs& args)
 {
-    verify_numargs(args, 1, "zero?");
-    BobNumber* num = dynamic_cast<BobNumber*>(args[0]);
-    return new BobBoolean(num && num->value() == 0);
+    return BobBoolean::get(is_number(args[0]) && number_value(args[0]) == 0);
 }
 
 
-static BobObject* builtin_logical_not(BuiltinArgs& args)
+static BobObject* builtin_logical_not(const BuiltinArgs& args)
 {
-    verify_numargs(args, 1, "not");
     BobBoolean* val = verify_argtype<BobBoolean>(args[0], "not expects a boolean");
-    return new BobBoolean(!val->value());
+    return BobBoolean::get(!val->value());
 }
 
 
 // The 'and' and 'or' builtins are conforming to the definition in R5RS,
 // section 4.2
 //
-static BobObject* builtin_logical_or(BuiltinArgs& args)
+static BobObject* builtin_logical_or(const BuiltinArgs& args)
 {
     if (args.size() < 1)
-        return new BobBoolean(false);
+        return BobBoolean::get(false);
 
-    for (BuiltinArgs::iterator arg = args.begin(); arg != args.end(); ++arg) {
-        BobBoolean* boolval = dynamic_cast<BobBoolean*>(*arg);
-        if (boolval && boolval->value())
-            return boolval;
+    for (BuiltinArgsIterator arg = args.begin(); arg != args.end(); ++arg) {
+        if (*arg == BobBoolean::get(true))
+            return *arg;
     }
 
     return args[args.size() - 1];
 }
 
 
-static BobObject* builtin_logical_and(BuiltinArgs& args)
+static BobObject* builtin_logical_and(const BuiltinArgs& args)
 {
     if (args.size() < 1)
-        return new BobBoolean(true);
+        return BobBoolean::get(true);
 
-    for (BuiltinArgs::iterator arg = args.begin(); arg != args.end(); ++arg) {
-        BobBoolean* boolval = dynamic_cast<BobBoolean*>(*arg);
-        if (boolval && !boolval->value())
-            return boolval;
+    for (BuiltinArgsIterator arg = args.begin(); arg != args.end(); ++arg) {
+        if (*arg == BobBoolean::get(false))
+            return *arg;
     }
 
     return args[args.size() - 1];
@@ -214,16 +199,15 @@ static BobObject* builtin_logical_and(BuiltinArgs& args)
 
 // A rough approximation of Scheme's eqv? that's good enough for most purposes.
 //
-static BobObject* eqv_p(BuiltinArgs& args)
+static BobObject* eqv_p(const BuiltinArgs& args)
 {
-    verify_numargs(args, 2, "eqv?");
     BobObject* lhs = args[0];
     BobObject* rhs = args[1];
 
-    if (dynamic_cast<BobPair*>(lhs) && dynamic_cast<BobPair*>(rhs))
-        return new BobBoolean(lhs == rhs); // pointer comparison
+    if (object_cast<BobPair>(lhs) && object_cast<BobPair>(rhs))
+        return BobBoolean::get(lhs == rhs); // pointer comparison
     else
-        return new BobBoolean(objects_equal(args[0], args[1]));
+        return BobBoolean::get(objects_equal(args[0], args[1]));
 }
 
 
@@ -233,46 +217,43 @@ static BobObject* eqv_p(BuiltinArgs& args)
 template <class ArithmeticFunction>
 static BobObject* builtin_arithmetic_generic(
                         string name,
-                        BuiltinArgs& args,
+                        const BuiltinArgs& args,
                         ArithmeticFunction func)
 {
     string typeerrmsg = name + " expects a numeric argument";
     builtin_verify(args.size() > 0, name + " expects arguments");
-    BobNumber* firstarg = verify_argtype<BobNumber>(args[0], typeerrmsg);
-    int result = firstarg->value();
-    for (BuiltinArgs::iterator arg = args.begin() + 1; arg != args.end(); ++arg) {
-        BobNumber* argnum = verify_argtype<BobNumber>(*arg, typeerrmsg);
-        result = func(result, argnum->value());
-    }
-    return new BobNumber(result);
+    int result = verify_number(args[0], typeerrmsg);
+    for (BuiltinArgsIterator arg = args.begin() + 1; arg != args.end(); ++arg)
+        result = func(result, verify_number(*arg, typeerrmsg));
+    return make_number(result);
 }
 
 
-static BobObject* builtin_add(BuiltinArgs& args)
+static BobObject* builtin_add(const BuiltinArgs& args)
 {
-    return builtin_arithmetic_generic("+", args, plus<int>());
+    return builtin_arithmetic_generic("+", args, add_numbers);
 }
 
 
-static BobObject* builtin_sub(BuiltinArgs& args)
+static BobObject* builtin_sub(const BuiltinArgs& args)
 {
-    return builtin_arithmetic_generic("-", args, minus<int>());
+    return builtin_arithmetic_generic("-", args, sub_numbers);
 }
 
 
-static BobObject* builtin_mul(BuiltinArgs& args)
+static BobObject* builtin_mul(const BuiltinArgs& args)
 {
-    return builtin_arithmetic_generic("*", args, multiplies<int>());
+    return builtin_arithmetic_generic("*", args, mul_numbers);
 }
 
 
-static BobObject* builtin_quotient(BuiltinArgs& args)
+static BobObject* builtin_quotient(const BuiltinArgs& args)
 {
     return builtin_arithmetic_generic("quotient", args, divides<int>());
 }
 
 
-static BobObject* builtin_modulo(BuiltinArgs& args)
+static BobObject* builtin_modulo(const BuiltinArgs& args)
 {
     return builtin_arithmetic_generic("modulo", args, modulus<int>());
 }
@@ -284,86 +265,93 @@ static BobObject* builtin_modulo(BuiltinArgs& args)
 template <class ComparisonFunction>
 static BobObject* builtin_comparison_generic(
                         string name,
-                        BuiltinArgs& args,
+                        const BuiltinArgs& args,
                         ComparisonFunction func)
 {
     string typeerrmsg = name + " expectes a numeric argument";
     builtin_verify(args.size() > 0, name + " expects arguments");
-    BobNumber* a = verify_argtype<BobNumber>(args[0], typeerrmsg);
-    for (BuiltinArgs::iterator arg = args.begin() + 1; arg != args.end(); ++arg) {
-        BobNumber* b = verify_argtype<BobNumber>(*arg, typeerrmsg);
-        if (func(a->value(), b->value()))
+    int a = verify_number(args[0], typeerrmsg);
+    for (BuiltinArgsIterator arg = args.begin() + 1; arg != args.end(); ++arg) {
+        int b = verify_number(*arg, typeerrmsg);
+        if (func(a, b))
             a = b;
         else
-            return new BobBoolean(false);
+            return BobBoolean::get(false);
     }
-    return new BobBoolean(true);
+    return BobBoolean::get(true);
 }
 
 
-static BobObject* builtin_equal_to(BuiltinArgs& args)
+static BobObject* builtin_equal_to(const BuiltinArgs& args)
 {
     return builtin_comparison_generic("=", args, equal_to<int>());
 }
 
 
-static BobObject* builtin_greater_equal(BuiltinArgs& args)
+static BobObject* builtin_greater_equal(const BuiltinArgs& args)
 {
     return builtin_comparison_generic(">=", args, greater_equal<int>());
 }
 
 
-static BobObject* builtin_less_equal(BuiltinArgs& args)
+static BobObject* builtin_less_equal(const BuiltinArgs& args)
 {
     return builtin_comparison_generic("<=", args, less_equal<int>());
 }
 
 
-static BobObject* builtin_greater(BuiltinArgs& args)
+static BobObject* builtin_greater(const BuiltinArgs& args)
 {
     return builtin_comparison_generic(">", args, greater<int>());
 }
 
 
-static BobObject* builtin_less(BuiltinArgs& args)
+static BobObject* builtin_less(const BuiltinArgs& args)
 {
     return builtin_comparison_generic("<", args, less<int>());
 }
 
 
+static void register_builtin(BuiltinsMap& builtins_map, const string& name, BuiltinProc proc, int arity)
+{
+    BuiltinSpec spec = {proc, arity};
+    builtins_map[name] = spec;
+}
+
+
 BuiltinsMap make_builtins_map()
 {
     BuiltinsMap builtins_map;
 
-    builtins_map["eq?"] = eqv_p;
-    builtins_map["eqv?"] = eqv_p;
-    builtins_map["car"] = car;
-    builtins_map["cdr"] = cdr;
-    builtins_map["cadr"] = cadr;
-    builtins_map["caddr"] = caddr;
-    builtins_map["set-car!"] = set_car;
-    builtins_map["set-cdr!"] = set_cdr;
-    builtins_map["cons"] = cons;
-    builtins_map["pair?"] = pair_p;
-    builtins_map["number?"] = number_p;
-    builtins_map["null?"] = null_p;
-    builtins_map["boolean?"] = boolean_p;
-    builtins_map["symbol?"] = symbol_p;
-    builtins_map["zero?"] = zero_p;
-    builtins_map["list"] = builtin_list;
-    builtins_map["+"] = builtin_add;
-    builtins_map["-"] = builtin_sub;
-    builtins_map["*"] = builtin_mul;
-    builtins_map["quotient"] = builtin_quotient;
-    builtins_map["modulo"] = builtin_modulo;
-    builtins_map["not"] = builtin_logical_not;
-    builtins_map["or"] = builtin_logical_or;
-    builtins_map["and"] = builtin_logical_and;
-    builtins_map["="] = builtin_equal_to;
-    builtins_map[">="] = builtin_greater_equal;
-    builtins_map["<="] = builtin_less_equal;
-    builtins_map[">"] = builtin_greater;
-    builtins_map["<"] = builtin_less;
+    register_builtin(builtins_map, "eq?", eqv_p, 2);
+    register_builtin(builtins_map, "eqv?", eqv_p, 2);
+    register_builtin(builtins_map, "car", car, 1);
+    register_builtin(builtins_map, "cdr", cdr, 1);
+    register_builtin(builtins_map, "cadr", cadr, 1);
+    register_builtin(builtins_map, "caddr", caddr, 1);
+    register_builtin(builtins_map, "set-car!", set_car, 2);
+    register_builtin(builtins_map, "set-cdr!", set_cdr, 2);
+    register_builtin(builtins_map, "cons", cons, 2);
+    register_builtin(builtins_map, "pair?", pair_p, 1);
+    register_builtin(builtins_map, "number?", number_p, 1);
+    register_builtin(builtins_map, "null?", null_p, 1);
+    register_builtin(builtins_map, "boolean?", boolean_p, 1);
+    register_builtin(builtins_map, "symbol?", symbol_p, 1);
+    register_builtin(builtins_map, "zero?", zero_p, 1);
+    register_builtin(builtins_map, "list", builtin_list, BUILTIN_VARIADIC);
+    register_builtin(builtins_map, "+", builtin_add, BUILTIN_VARIADIC);
+    register_builtin(builtins_map, "-", builtin_sub, BUILTIN_VARIADIC);
+    register_builtin(builtins_map, "*", builtin_mul, BUILTIN_VARIADIC);
+    register_builtin(builtins_map, "quotient", builtin_quotient, BUILTIN_VARIADIC);
+    register_builtin(builtins_map, "modulo", builtin_modulo, BUILTIN_VARIADIC);
+    register_builtin(builtins_map, "not", builtin_logical_not, 1);
+    register_builtin(builtins_map, "or", builtin_logical_or, BUILTIN_VARIADIC);
+    register_builtin(builtins_map, "and", builtin_logical_and, BUILTIN_VARIADIC);
+    register_builtin(builtins_map, "=", builtin_equal_to, BUILTIN_VARIADIC);
+    register_builtin(builtins_map, ">=", builtin_greater_equal, BUILTIN_VARIADIC);
+    register_builtin(builtins_map, "<=", builtin_less_equal, BUILTIN_VARIADIC);
+    register_builtin(builtins_map, ">", builtin_greater, BUILTIN_VARIADIC);
+    register_builtin(builtins_map, "<", builtin_less, BUILTIN_VARIADIC);
 
     return builtins_map;
 }
@@ -15,15 +15,43 @@
 #include <stdexcept>
 
 
+// The arguments of a builtin call: a view of the values where they already
+// are (on the VM's value stack), so that calling a builtin doesn't copy
+// them. It's only valid for the duration of the call.
+//
+class BuiltinArgs
+{
+public:
+    typedef BobObject* const* const_iterator;
+
+    BuiltinArgs(BobObject* const* args, size_t count)
+        : m_args(args), m_count(count)
+    {}
+
+    size_t size() const {return m_count;}
+    BobObject* operator[](size_t i) const {return m_args[i];}
+    const_iterator begin() const {return m_args;}
+    const_iterator end() const {return m_args + m_count;}
+
+private:
+    BobObject* const* m_args;
+    size_t m_count;
+};
+
+typedef BuiltinArgs::const_iterator BuiltinArgsIterator;
+typedef BuiltinArgs::const_iterator BuiltinArgsIteratorConst;
+
+
 // Builtin procedures are implemented as normal C++ functions with the 
-// following signature. They accept a varying amount of arguments in 
-// a vector and return a single value. All values (args and return value)
-// are BobObjects.
+// following signature. They accept a varying amount of arguments and
+// return a single value. All values (args and return value) are BobObjects.
+//
+typedef BobObject* (*BuiltinProc)(const BuiltinArgs& args);
+
+
+// Arity of builtins accepting any number of arguments
 //
-typedef std::vector<BobObject*> BuiltinArgs;
-typedef std::vector<BobObject*>::iterator BuiltinArgsIterator;
-typedef std::vector<BobObject*>::const_iterator BuiltinArgsIteratorConst;
-typedef BobObject* (*BuiltinProc)(BuiltinArgs& args);
+const int BUILTIN_VARIADIC = -1;
 
 
 // The exception type thrown by builtins when they're used incorrectly by
@@ -45,8 +73,14 @@ struct BuiltinError : public std::runtime_error
 class BobBuiltinProcedure : public BobObject
 {
 public:
-    BobBuiltinProcedure(const std::string& name, BuiltinProc proc)
-        : m_name(name), m_proc(proc)
+    static const BobType type_tag = TYPE_BUILTIN_PROCEDURE;
+
+    // arity is the number of arguments the builtin expects, or
+    // BUILTIN_VARIADIC. Calls with a different number of arguments are
+    // rejected before reaching the builtin.
+    //
+    BobBuiltinProcedure(const std::string& name, BuiltinProc proc, int arity)
+        : BobObject(type_tag), m_name(name), m_proc(proc), m_arity(arity)
     {}
 
     virtual ~BobBuiltinProcedure()
@@ -57,7 +91,16 @@ public:
         return m_name;
     }
 
-    virtual BobObject* exec(BuiltinArgs& args) const
+    // Check the number of arguments and run the builtin.
+    //
+    BobObject* call(const BuiltinArgs& args) const
+    {
+        if (m_arity != BUILTIN_VARIADIC && args.size() != static_cast<size_t>(m_arity))
+            throw BuiltinError(format_string("%s expects %d arguments", m_name.c_str(), m_arity));
+        return exec(args);
+    }
+
+    virtual BobObject* exec(const BuiltinArgs& args) const
     {
         return m_proc(args);
     }
@@ -69,13 +112,20 @@ public:
 private:
     std::string m_name;
     BuiltinProc m_proc;
+    int m_arity;
 };
 
 
 // Call init_builtins_map to fill in a BuiltinsMap with all the available
 // builtins.
 //
-typedef std::map<std::string, BuiltinProc> BuiltinsMap;
+struct BuiltinSpec
+{
+    BuiltinProc proc;
+    int arity;
+};
+
+typedef std::map<std::string, BuiltinSpec> BuiltinsMap;
 BuiltinsMap make_builtins_map();
 
 
@@ -5,7 +5,9 @@
 // This code is in the public domain
 //*****************************************************************************
 #include "bytecode.h"
+#include "serialization.h"
 #include "utils.h"
+#include <algorithm>
 #include <cassert>
 
 using namespace std;
@@ -19,12 +21,23 @@ static string opcode2str(unsigned opcode)
         DEF_OP_STR(LOADVAR);
         DEF_OP_STR(STOREVAR);
         DEF_OP_STR(DEFVAR);
+        DEF_OP_STR(LOADLOCAL);
+        DEF_OP_STR(STORELOCAL);
         DEF_OP_STR(FUNCTION);
         DEF_OP_STR(POP);
         DEF_OP_STR(JUMP);
         DEF_OP_STR(FJUMP);
         DEF_OP_STR(RETURN);
         DEF_OP_STR(CALL);
+        DEF_OP_STR(TAILCALL);
+        DEF_OP_STR(ADD);
+        DEF_OP_STR(SUB);
+        DEF_OP_STR(MUL);
+        DEF_OP_STR(NUMEQ);
+        DEF_OP_STR(LT);
+        DEF_OP_STR(GT);
+        DEF_OP_STR(LE);
+        DEF_OP_STR(GE);
         default: return "UNKNOWN";
     }
 }
@@ -37,13 +50,16 @@ static string repr_nested(const BobCodeObject* codeobj, unsigned nesting = 0)
     // Header
     //
     string repr = format_string("%s----------\n%sCodeObject: %s\n", 
-                    prefix.c_str(), prefix.c_str(), codeobj->name.c_str());
+                    prefix.c_str(), prefix.c_str(), codeobj->name.str().c_str());
+
+    if (!codeobj->is_materialized())
+        return repr + prefix + "  (not loaded)\n" + prefix + "----------\n";
 
     // Arguments
     //
     repr.append(prefix + "Args: [");
-    for (vector<string>::const_iterator arg = codeobj->args.begin(); arg != codeobj->args.end(); ++arg) {
-        repr.append(*arg);
+    for (vector<StringRef>::const_iterator arg = codeobj->args.begin(); arg != codeobj->args.end(); ++arg) {
+        repr.append(arg->data(), arg->size());
         repr.append(" ");
     }
     repr.append("]\n");
@@ -63,13 +79,13 @@ static string repr_nested(const BobCodeObject* codeobj, unsigned nesting = 0)
             case OP_CONST: {
                 arg_repr = format_string("%4d {= ", instruction.arg);
                 const BobObject* constant = codeobj->constants[instruction.arg];
-                arg_repr.append(constant->repr() + "}");
+                arg_repr.append(object_repr(constant) + "}");
                 break;
             }
             case OP_FUNCTION: {
                 arg_repr = format_string("%4d {=\n", instruction.arg);
                 const BobObject* constant = codeobj->constants[instruction.arg];
-                const BobCodeObject* function = dynamic_cast<const BobCodeObject*>(constant);
+                const BobCodeObject* function = object_cast<BobCodeObject>(constant);
                 assert(function && "Expect BobCodeObject as argument of OP_FUNCTION");
                 arg_repr.append(repr_nested(function, nesting + 8));
                 break;
@@ -77,13 +93,29 @@ static string repr_nested(const BobCodeObject* codeobj, unsigned nesting = 0)
             case OP_LOADVAR:
             case OP_STOREVAR:
             case OP_DEFVAR:
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_NUMEQ:
+            case OP_LT:
+            case OP_GT:
+            case OP_LE:
+            case OP_GE:
                 arg_repr = format_string("%4d {=%s}", 
                                 instruction.arg, 
-                                codeobj->varnames[instruction.arg].c_str());
+                                codeobj->varnames[instruction.arg]->name().c_str());
+                break;
+            case OP_LOADLOCAL:
+            case OP_STORELOCAL:
+                arg_repr = format_string("%4d {=%u,%u}",
+                                instruction.arg,
+                                instruction.arg >> LOCAL_DEPTH_SHIFT,
+                                instruction.arg & LOCAL_INDEX_MASK);
                 break;
             case OP_FJUMP:
             case OP_JUMP:
             case OP_CALL:
+            case OP_TAILCALL:
                 arg_repr = format_string("%4d", instruction.arg);
                 break;
             case OP_POP:
@@ -106,10 +138,220 @@ string BobCodeObject::repr() const
 }
 
 
-void BobCodeObject::gc_mark_pointed()
+void BobCodeObject::predecode()
+{
+    // This is the top-level code object, which doesn't run in a frame.
+    //
+    predecode(vector<unsigned>());
+}
+
+
+void BobCodeObject::materialize()
+{
+    assert(!is_materialized() && enclosing && "Only a nested code object that isn't loaded can be materialized");
+    BobPermanentScope permanent;
+    loader->load(this);
+    loader = 0;
+    predecode(scope_frame_sizes());
+}
+
+
+void BobCodeObject::link_nested()
+{
+    frame_size = compute_frame_size();
+
+    // Invalid references are reported by predecode_alone
+    //
+    for (vector<BobInstruction>::const_iterator instr = code.begin(); instr != code.end(); ++instr) {
+        if (instr->opcode == OP_FUNCTION && instr->arg < constants.size()) {
+            if (BobCodeObject* nested = object_cast<BobCodeObject>(constants[instr->arg]))
+                nested->enclosing = this;
+        }
+    }
+}
+
+
+void BobCodeObject::predecode_alone()
+{
+    predecode_code(scope_frame_sizes(), false);
+}
+
+
+// The sizes of the frames in scope of this code object: its own, followed
+// by those of the enclosing procedures. The top-level code doesn't run in a
+// frame.
+//
+vector<unsigned> BobCodeObject::scope_frame_sizes() const
+{
+    vector<unsigned> frame_sizes;
+    if (enclosing) {
+        frame_sizes.push_back(frame_size);
+        for (const BobCodeObject* outer = enclosing; outer->enclosing; outer = outer->enclosing)
+            frame_sizes.push_back(outer->frame_size);
+    }
+    return frame_sizes;
+}
+
+
+unsigned BobCodeObject::compute_frame_size() const
+{
+    unsigned size = args.size();
+    for (vector<BobInstruction>::const_iterator instr = code.begin(); instr != code.end(); ++instr) {
+        if ((instr->opcode == OP_LOADLOCAL || instr->opcode == OP_STORELOCAL) &&
+            (instr->arg >> LOCAL_DEPTH_SHIFT) == 0)
+            size = max(size, (instr->arg & LOCAL_INDEX_MASK) + 1);
+    }
+    return size;
+}
+
+
+void BobCodeObject::predecode(const vector<unsigned>& enclosing_frame_sizes)
+{
+    // Nested code objects are predecoded with this code object's frame in
+    // their scope, so its size has to be known first.
+    //
+    vector<unsigned> frame_sizes = enclosing_frame_sizes;
+    if (!frame_sizes.empty()) {
+        frame_size = compute_frame_size();
+        frame_sizes[0] = frame_size;
+    }
+    predecode_code(frame_sizes, true);
+}
+
+
+// Build exec_code with the given frames in scope, recursively predecoding
+// the nested code objects that are loaded if recursive is set.
+//
+void BobCodeObject::predecode_code(const vector<unsigned>& frame_sizes, bool recursive)
+{
+    // Jump targets point into exec_code and global references into
+    // global_caches, so both must have their final size before any of them
+    // is resolved.
+    //
+    exec_code.assign(code.size() + 1, BobExecInstruction());
+    size_t num_global_refs = 0;
+    for (vector<BobInstruction>::const_iterator instr = code.begin(); instr != code.end(); ++instr) {
+        if (instr->opcode == OP_LOADVAR || instr->opcode == OP_STOREVAR ||
+            (instr->opcode >= OP_ADD && instr->opcode <= OP_GE))
+            ++num_global_refs;
+    }
+    global_caches.assign(num_global_refs, BobGlobalCache());
+    vector<BobGlobalCache>::iterator next_global_cache = global_caches.begin();
+
+    // returns[offset] is set if the code returns from offset right away,
+    // maybe after jumping forward. The compiler emits arithmetic and
+    // comparisons in tail position followed by such code.
+    //
+    vector<bool> returns(code.size() + 1, false);
+    for (size_t offset = code.size(); offset-- > 0;) {
+        const BobInstruction& instr = code[offset];
+        returns[offset] = instr.opcode == OP_RETURN ||
+            (instr.opcode == OP_JUMP && instr.arg > offset && instr.arg <= code.size() && returns[instr.arg]);
+    }
+
+    for (size_t offset = 0; offset < code.size(); ++offset) {
+        const BobInstruction& instr = code[offset];
+        BobExecInstruction& exec_instr = exec_code[offset];
+        exec_instr.opcode = instr.opcode;
+
+        switch (instr.opcode) {
+            case OP_CONST:
+                if (instr.arg >= constants.size())
+                    throw DeserializationError(format_string("Constant %u out of range in %s", instr.arg, name.str().c_str()));
+                exec_instr.constant = constants[instr.arg];
+                break;
+            case OP_FUNCTION:
+            {
+                if (instr.arg >= constants.size())
+                    throw DeserializationError(format_string("Constant %u out of range in %s", instr.arg, name.str().c_str()));
+                exec_instr.codeobject = object_cast<BobCodeObject>(constants[instr.arg]);
+                if (!exec_instr.codeobject)
+                    throw DeserializationError("Expected code object as the argument to OP_FUNCTION");
+                if (!recursive)
+                    break;
+                exec_instr.codeobject->enclosing = this;
+
+                // The nested procedure's own frame comes first in its scope;
+                // its size is filled in by the nested predecode. One that
+                // isn't materialized yet is predecoded when it is.
+                //
+                if (exec_instr.codeobject->is_materialized()) {
+                    vector<unsigned> nested_frame_sizes(1, 0);
+                    nested_frame_sizes.insert(nested_frame_sizes.end(), frame_sizes.begin(), frame_sizes.end());
+                    exec_instr.codeobject->predecode(nested_frame_sizes);
+                }
+                break;
+            }
+            case OP_LOADVAR:
+            case OP_STOREVAR:
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_NUMEQ:
+            case OP_LT:
+            case OP_GT:
+            case OP_LE:
+            case OP_GE:
+                if (instr.arg >= varnames.size())
+                    throw DeserializationError(format_string("Varname %u out of range in %s", instr.arg, name.str().c_str()));
+                exec_instr.global = &*next_global_cache++;
+                exec_instr.global->atom = varnames[instr.arg];
+                exec_instr.global->env = 0;
+                exec_instr.global->generation = 0;
+                exec_instr.global->cell = 0;
+                exec_instr.tail = instr.opcode >= OP_ADD && returns[offset + 1];
+                break;
+            case OP_DEFVAR:
+                if (instr.arg >= varnames.size())
+                    throw DeserializationError(format_string("Varname %u out of range in %s", instr.arg, name.str().c_str()));
+                exec_instr.atom = varnames[instr.arg];
+                break;
+            case OP_LOADLOCAL:
+            case OP_STORELOCAL:
+                exec_instr.local.depth = instr.arg >> LOCAL_DEPTH_SHIFT;
+                exec_instr.local.index = instr.arg & LOCAL_INDEX_MASK;
+                if (exec_instr.local.depth >= frame_sizes.size() ||
+                    exec_instr.local.index >= frame_sizes[exec_instr.local.depth])
+                    throw DeserializationError(format_string("Local variable %u,%u out of range in %s",
+                                    exec_instr.local.depth, exec_instr.local.index, name.str().c_str()));
+                break;
+            case OP_JUMP:
+            case OP_FJUMP:
+                if (instr.arg > code.size())
+                    throw DeserializationError(format_string("Jump target %u out of range in %s", instr.arg, name.str().c_str()));
+                exec_instr.target = &exec_code[instr.arg];
+                break;
+            case OP_CALL:
+            case OP_TAILCALL:
+                exec_instr.count = instr.arg;
+                break;
+            case OP_POP:
+            case OP_RETURN:
+                exec_instr.count = 0;
+                break;
+            default:
+                throw DeserializationError(format_string("Invalid instruction opcode 0x%02X", instr.opcode));
+        }
+    }
+
+    exec_code[code.size()].opcode = OP_END;
+    exec_code[code.size()].count = 0;
+}
+
+
+void BobCodeObject::gc_visit_pointed(BobObjectVisitor& visitor)
 {
     for (vector<BobObject*>::iterator it = constants.begin(); it != constants.end(); ++it)
-        (*it)->gc_mark();
+        visitor.visit(*it);
+
+    // The predecoded instructions hold their own copies of the constants
+    // they refer to, which have to follow the constants if they move.
+    for (vector<BobExecInstruction>::iterator it = exec_code.begin(); it != exec_code.end(); ++it) {
+        if (it->opcode == OP_CONST)
+            visitor.visit(it->constant);
+        else if (it->opcode == OP_FUNCTION)
+            visitor.visit(it->codeobject);
+    }
 }
 
 
@@ -8,6 +8,9 @@
 #define BYTECODE_H
 
 #include "bobobject.h"
+#include "atom.h"
+#include "environment.h"
+#include "utils.h"
 #include <string>
 #include <vector>
 
@@ -18,14 +21,39 @@ const unsigned OP_CONST      = 0x00;
 const unsigned OP_LOADVAR    = 0x10;
 const unsigned OP_STOREVAR   = 0x11;
 const unsigned OP_DEFVAR     = 0x12;
+const unsigned OP_LOADLOCAL  = 0x13;
+const unsigned OP_STORELOCAL = 0x14;
 const unsigned OP_FUNCTION   = 0x20;
 const unsigned OP_POP        = 0x30;
 const unsigned OP_JUMP       = 0x40;
 const unsigned OP_FJUMP      = 0x41;
 const unsigned OP_RETURN     = 0x50;
 const unsigned OP_CALL       = 0x51;
+const unsigned OP_TAILCALL   = 0x52;
+const unsigned OP_ADD        = 0x60;
+const unsigned OP_SUB        = 0x61;
+const unsigned OP_MUL        = 0x62;
+const unsigned OP_NUMEQ      = 0x63;
+const unsigned OP_LT         = 0x64;
+const unsigned OP_GT         = 0x65;
+const unsigned OP_LE         = 0x66;
+const unsigned OP_GE         = 0x67;
 const unsigned OP_INVALID    = 0xFF;
 
+// Internal opcode terminating the executable stream of a code object.
+// Never appears in serialized bytecode.
+//
+const unsigned OP_END        = 0xFE;
+
+
+// The argument of OP_LOADLOCAL and OP_STORELOCAL packs the lexical address
+// of a variable in a procedure frame: the number of frames to climb from the
+// current one (depth) in bits 16..23, and the slot index in bits 0..15 of
+// the 24-bit argument.
+//
+const unsigned LOCAL_DEPTH_SHIFT = 16;
+const unsigned LOCAL_INDEX_MASK  = 0xFFFF;
+
 
 // An instruction is a POD type containing the opcode and a single
 // numeric argument (for instructions that need it)
@@ -41,10 +69,83 @@ struct BobInstruction
 };
 
 
+class BobCodeObject;
+
+
+// The lexical address of a variable in a procedure frame, as packed in the
+// argument of OP_LOADLOCAL and OP_STORELOCAL
+//
+struct BobLocalRef
+{
+    unsigned depth;
+    unsigned index;
+};
+
+
+// Inline cache of a global variable reference. After the first lookup it
+// holds the binding cell of the variable in env, which stays valid as long
+// as no binding has been added to (or environment removed from) the
+// environment hierarchy since, as counted by
+// BobEnvironment::binding_generation.
+//
+struct BobGlobalCache
+{
+    const BobAtom* atom;
+    const BobEnvironment* env;
+    unsigned long generation;
+    BobObject** cell;
+};
+
+
+// An instruction of the executable stream the VM runs. It's created from a
+// BobInstruction by BobCodeObject::predecode, which replaces the numeric
+// argument by the operand it refers to.
+//
+struct BobExecInstruction
+{
+    unsigned opcode;
+
+    // For OP_ADD..OP_GE: the code returns right after the instruction, so
+    // a call it makes to a procedure bound to its name is a tail call
+    //
+    bool tail;
+
+    union {
+        BobObject* constant;                // OP_CONST
+        const BobAtom* atom;                // OP_DEFVAR
+        BobGlobalCache* global;             // OP_LOADVAR, OP_STOREVAR, OP_ADD..OP_GE
+        BobLocalRef local;                  // OP_LOADLOCAL, OP_STORELOCAL
+        BobCodeObject* codeobject;          // OP_FUNCTION
+        const BobExecInstruction* target;   // OP_JUMP, OP_FJUMP
+        unsigned count;                     // OP_CALL, OP_TAILCALL
+    };
+};
+
+
+// Fills in code objects that were loaded lazily. See
+// BobCodeObject::materialize.
+//
+class BobCodeLoader
+{
+public:
+    virtual ~BobCodeLoader()
+    {}
+
+    // Set the args, constants, varnames and code of codeobj, which was
+    // created by this loader. Throws DeserializationError if they can't be
+    // loaded.
+    //
+    virtual void load(BobCodeObject* codeobj) = 0;
+};
+
+
 class BobCodeObject : public BobObject
 {
 public:
+    static const BobType type_tag = TYPE_CODE_OBJECT;
+
     BobCodeObject()
+        : BobObject(type_tag), loader(0), loader_index(0), enclosing(0), frame_size(0)
     {}
 
     virtual ~BobCodeObject()
@@ -52,13 +153,113 @@ public:
 
     std::string repr() const;
 
-    std::string name;
-    std::vector<std::string> args;
-    std::vector<std::string> varnames;
+    // Build exec_code from code and compute frame_size, recursively for all
+    // the code objects nested in this one that are loaded. Throws
+    // DeserializationError if the code refers to constants, names, local
+    // variables or jump targets that don't exist.
+    //
+    void predecode();
+
+    // A code object nested in another may be created with only its name,
+    // and loader set to fill in the rest when the procedure is first
+    // called, so that the code of procedures a program never calls is
+    // never loaded. materialize() loads and predecodes it, as a permanent
+    // object like everything loaded from bytecode.
+    //
+    bool is_materialized() const
+    {
+        return loader == 0;
+    }
+
+    void materialize();
+
+    // For loaders that load all the code objects of a bytecode up front,
+    // in parallel: once they're all loaded, link_nested() computes
+    // frame_size and sets enclosing of the code objects this one's code
+    // defines, and once they're all linked, predecode_alone() predecodes
+    // this one without the ones nested in it. Either may run concurrently
+    // for different code objects.
+    //
+    void link_nested();
+    void predecode_alone();
+
+    // The loader of a code object that isn't materialized yet, and an
+    // index the loader finds it by.
+    //
+    BobCodeLoader* loader;
+    unsigned loader_index;
+
+    // The code object whose code defines this one with OP_FUNCTION, and
+    // whose frames are therefore in this one's scope. Set by predecode or
+    // link_nested; 0 for the top-level code object.
+    //
+    BobCodeObject* enclosing;
+
+    // The names refer to the text of the bytecode file the code object was
+    // loaded from. The names of global variables are interned when they're
+    // loaded.
+    //
+    StringRef name;
+    std::vector<StringRef> args;
+    std::vector<const BobAtom*> varnames;
     std::vector<BobObject*> constants;
     std::vector<BobInstruction> code;
 
-    virtual void gc_mark_pointed();
+    // The number of slots in the frame of a call to this procedure: its
+    // arguments followed by its internal definitions. Every slot beyond the
+    // arguments is assigned by an OP_STORELOCAL at depth 0 in this code
+    // object, so it's derived from the code.
+    //
+    unsigned frame_size;
+
+    // The executable form of the code, terminated by OP_END.
+    //
+    std::vector<BobExecInstruction> exec_code;
+
+    // The inline caches of the instructions in exec_code that refer to
+    // global variables, one per instruction.
+    //
+    std::vector<BobGlobalCache> global_caches;
+
+    virtual void gc_visit_pointed(BobObjectVisitor& visitor);
+
+private:
+    void predecode(const std::vector<unsigned>& enclosing_frame_sizes);
+    void predecode_code(const std::vector<unsigned>& frame_sizes, bool recursive);
+    unsigned compute_frame_size() const;
+    std::vector<unsigned> scope_frame_sizes() const;
+};
+
+// A closure is a code object (procedure) with an associated environment
+// in which the closure was created. The environment is the frame of the
+// enclosing procedure, or 0 for closures created by top-level code.
+//
+class BobClosure : public BobObject
+{
+public:
+    static const BobType type_tag = TYPE_CLOSURE;
+
+    BobClosure(BobCodeObject* codeobject_, BobFrame* env_)
+        : BobObject(type_tag), codeobject(codeobject_), env(env_)
+    {}
+
+    virtual ~BobClosure()
+    {}
+
+    virtual std::string repr() const
+    {
+        return format_string("<closure '%s'>", codeobject->name.str().c_str());
+    }
+
+    BobCodeObject* codeobject;
+    BobFrame* env;
+
+    virtual void gc_visit_pointed(BobObjectVisitor& visitor)
+    {
+        visitor.visit(codeobject);
+        if (env)
+            visitor.visit(env);
+    }
 };
 
 #endif /* BYTECODE_H */
@@ -9,7 +9,12 @@
 using namespace std;
 
 
-BobObject* BobEnvironment::lookup_var(const string& name)
+// Starts at 1 so that a zero-initialized cache is never valid.
+//
+unsigned long BobEnvironment::s_binding_generation = 1;
+
+
+BobObject* BobEnvironment::lookup_var(const BobAtom* name)
 {
     Binding::const_iterator it = m_binding.find(name);
     if (it == m_binding.end())
@@ -19,30 +24,93 @@ BobObject* BobEnvironment::lookup_var(const string& name)
 }
 
 
-void BobEnvironment::define_var(const string& name, BobObject* value)
+BobObject** BobEnvironment::lookup_cell(const BobAtom* name)
 {
-    m_binding[name] = value;
+    Binding::iterator it = m_binding.find(name);
+    if (it == m_binding.end())
+        return m_parent ? m_parent->lookup_cell(name) : 0;
+    else
+        return &it->second;
 }
 
 
-BobObject* BobEnvironment::set_var_value(const string& name, BobObject* value)
+void BobEnvironment::define_var(const BobAtom* name, BobObject* value)
 {
-    Binding::const_iterator it = m_binding.find(name);
+    gc_write_barrier(value);
+
+    // Redefining an existing binding keeps its cell, so only new bindings
+    // invalidate cached cells.
+    //
+    pair<Binding::iterator, bool> inserted = m_binding.insert(make_pair(name, value));
+    if (inserted.second)
+        ++s_binding_generation;
+    else
+        inserted.first->second = value;
+}
+
+
+BobObject* BobEnvironment::set_var_value(const BobAtom* name, BobObject* value)
+{
+    Binding::iterator it = m_binding.find(name);
     if (it == m_binding.end())
         return m_parent ? m_parent->set_var_value(name, value) : 0;
     else {
-        m_binding[name] = value;
+        gc_write_barrier(value);
+        it->second = value;
         return value;
     }
 }
  
 
-void BobEnvironment::gc_mark_pointed()
+void BobEnvironment::gc_visit_pointed(BobObjectVisitor& visitor)
 {
     for (Binding::iterator it = m_binding.begin(); it != m_binding.end(); ++it)
-        it->second->gc_mark();
+        visitor.visit(it->second);
     if (m_parent)
-        m_parent->gc_mark();
+        visitor.visit(m_parent);
+}
+
+
+BobFrame::BobFrame(BobFrame* parent, unsigned size)
+    : BobObject(type_tag), m_parent(parent), m_size(size)
+{
+    for (unsigned i = 0; i < size; ++i)
+        slots()[i] = 0;
+}
+
+
+BobFrame* BobFrame::create(BobFrame* parent, unsigned size)
+{
+    return new (size) BobFrame(parent, size);
+}
+
+
+void* BobFrame::operator new(size_t sz, unsigned size)
+{
+    return BobAllocator::get().allocate_object(sz + size * sizeof(BobObject*));
+}
+
+
+void BobFrame::operator delete(void* p, unsigned size)
+{
+    (void)size;
+    BobAllocator::get().release_object(p);
+}
+
+
+void BobFrame::operator delete(void* p)
+{
+    BobAllocator::get().release_object(p);
 }
 
 
+void BobFrame::gc_visit_pointed(BobObjectVisitor& visitor)
+{
+    BobObject** values = slots();
+    for (unsigned i = 0; i < m_size; ++i) {
+        if (values[i])
+            visitor.visit(values[i]);
+    }
+    if (m_parent)
+        visitor.visit(m_parent);
+}
@@ -8,12 +8,12 @@
 #define ENVIRONMENT_H
 
 #include "bobobject.h"
-#include <string>
+#include "atom.h"
 #include <map>
 
 
 // An environment in which variables are bound to values. Variable names are
-// strings, values are BobObject*.
+// interned atoms, values are BobObject*.
 //
 // Environment objects are linked via parent pointers. When bindings are
 // queried or assigned and the variable name isn't bound in the environment,
@@ -22,41 +22,135 @@
 // An environment hierarchy ultimately terminates with a "top-level"
 // environment, which has 0 as its parent link.
 //
+// The VM uses BobEnvironment only for the global environment. Variables of
+// procedures live in BobFrame slots.
+//
 class BobEnvironment : public BobObject
 {
 public:
+    static const BobType type_tag = TYPE_ENVIRONMENT;
+
     // Create a new, empty environment with the given parent link
     //
     BobEnvironment(BobEnvironment* parent=0)
-        : m_parent(parent)
+        : BobObject(type_tag), m_parent(parent)
     {}
 
     // Lookup the variable in this environment or its parents. Return the
     // object if found, 0 otherwise.
     //
-    BobObject* lookup_var(const std::string& name);
+    BobObject* lookup_var(const BobAtom* name);
+
+    // Like lookup_var, but return the address of the binding's value, which
+    // is valid until binding_generation changes. Return 0 if not found.
+    //
+    BobObject** lookup_cell(const BobAtom* name);
 
     // Add a name -> value binding to this environment. If a binding for the
     // name already exists, it is overridden.
     //
-    void define_var(const std::string& name, BobObject* value);
+    void define_var(const BobAtom* name, BobObject* value);
 
     // Find the binding of name in this environment or its parents and assign
     // the new value to it. Return the value if successful, or 0 if no
     // binding for the name was found.
     //
-    BobObject* set_var_value(const std::string& name, BobObject* value);
+    BobObject* set_var_value(const BobAtom* name, BobObject* value);
+
+    // The bindings of this environment, without those of its parents
+    //
+    typedef std::map<const BobAtom*, BobObject*> Binding;
+
+    const Binding& bindings() const
+    {
+        return m_binding;
+    }
+
+    // A counter incremented whenever a new binding is added to any
+    // environment, or an environment is destroyed. Either may change which
+    // binding a name resolves to, so cached binding cells must be looked up
+    // again.
+    //
+    static unsigned long binding_generation()
+    {
+        return s_binding_generation;
+    }
 
     virtual ~BobEnvironment()
-    {}
+    {
+        ++s_binding_generation;
+    }
 
-    virtual void gc_mark_pointed();
+    virtual void gc_visit_pointed(BobObjectVisitor& visitor);
 private:
+    static unsigned long s_binding_generation;
+
     BobEnvironment* m_parent;
-    typedef std::map<std::string, BobObject*> Binding;
     Binding m_binding;
 };
 
 
+// The frame of a procedure call: a fixed-size array of slots holding the
+// procedure's arguments followed by its internal definitions. The compiler
+// resolves references to these variables into (depth, index) pairs, where
+// depth is the number of parent links to follow from the current frame.
+//
+// Frames of procedures defined at top level have 0 as their parent link;
+// their free variables are global.
+//
+// The slots are allocated inline, right after the object, so a frame is a
+// single allocation. Create frames with BobFrame::create.
+//
+class BobFrame : public BobObject
+{
+public:
+    static const BobType type_tag = TYPE_FRAME;
+
+    // Create a new frame with the given parent link and number of slots.
+    // All slots are unbound (0).
+    //
+    static BobFrame* create(BobFrame* parent, unsigned size);
+
+    BobFrame* parent() const {return m_parent;}
+    unsigned size() const {return m_size;}
+
+    // The frame depth links up from this one
+    //
+    BobFrame* ancestor(unsigned depth)
+    {
+        BobFrame* frame = this;
+        while (depth-- > 0)
+            frame = frame->m_parent;
+        return frame;
+    }
+
+    BobObject* slot(unsigned index) const {return slots()[index];}
+    void set_slot(unsigned index, BobObject* value)
+    {
+        gc_write_barrier(value);
+        slots()[index] = value;
+    }
+
+    void* operator new(size_t sz, unsigned size);
+    void operator delete(void* p, unsigned size);
+    void operator delete(void* p);
+
+    virtual ~BobFrame()
+    {}
+
+    virtual void gc_visit_pointed(BobObjectVisitor& visitor);
+private:
+    BobFrame(BobFrame* parent, unsigned size);
+
+    BobObject** slots() const
+    {
+        return reinterpret_cast<BobObject**>(const_cast<BobFrame*>(this) + 1);
+    }
+
+    BobFrame* m_parent;
+    unsigned m_size;
+};
+
+
 
 #endif /* ENVIRONMENT_H */
@@ -5,6 +5,9 @@
 // This code is in the public domain
 //*****************************************************************************
 #include <iostream>
+#include <cstdlib>
+#include <cctype>
+#include <cstring>
 #include "basicobjects.h"
 #include "bobobject.h"
 #include "utils.h"
@@ -16,32 +19,151 @@ using namespace std;
 
 // Set these for debugging or testing the garbage collector.
 // A high threshold means the GC won't actually run in the tests.
+// The threshold, the heap growth and the pause budget are the defaults of
+// the command-line options setting them.
 //
 const bool GC_DEBUGGING = false;
 const size_t GC_SIZE_THRESHOLD = 20 * 1024 * 1024;
+const double GC_HEAP_GROWTH = 2.0;
+const unsigned GC_PAUSE_BUDGET_US = 0;
+
+
+static void usage()
+{
+    cerr << "Usage: barevm [options] <file.bobc>\n"
+         << "Options:\n"
+         << "  --gc-min-threshold=SIZE  collect after allocating at least SIZE bytes\n"
+         << "  --gc-max-threshold=SIZE  collect after allocating at most SIZE bytes (0: no limit)\n"
+         << "  --gc-growth=FACTOR       let the heap grow to FACTOR times the live data\n"
+         << "  --gc-time-ratio=RATIO    grow the heap faster while the GC takes more than\n"
+         << "                           RATIO of the run time (0: off)\n"
+         << "  --gc-pause-budget=US     mark incrementally, pausing for about US\n"
+         << "                           microseconds at a time (0: stop the world)\n"
+         << "  --load-threads=N         load large bytecode up front with N threads\n"
+         << "  --snapshot-in=FILE       add the definitions of a heap image before running\n"
+         << "  --snapshot-out=FILE      save the definitions into a heap image after running\n"
+         << "SIZE is in bytes, or in kilobytes, megabytes or gigabytes with a K, M or G suffix.\n";
+}
+
+
+// If arg is "--name=value", set value and return true
+//
+static bool parse_option(const char* arg, const char* name, const char*& value)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+        return false;
+    value = arg + len + 1;
+    return true;
+}
+
+
+static bool parse_size(const char* str, size_t& size)
+{
+    char* end;
+    double value = strtod(str, &end);
+    if (end == str || value < 0)
+        return false;
+    switch (*end) {
+        case 'G': case 'g': value *= 1024;  // fall through
+        case 'M': case 'm': value *= 1024;  // fall through
+        case 'K': case 'k': value *= 1024; ++end; break;
+        default: break;
+    }
+    if (*end)
+        return false;
+    size = static_cast<size_t>(value);
+    return true;
+}
+
+
+static bool parse_double(const char* str, double& value)
+{
+    char* end;
+    value = strtod(str, &end);
+    return end != str && !*end && value >= 0;
+}
+
+
+static bool parse_unsigned(const char* str, unsigned& value)
+{
+    char* end;
+    unsigned long n = strtoul(str, &end, 10);
+    value = static_cast<unsigned>(n);
+    return end != str && !*end && isdigit(*str) && n == value;
+}
 
 
 int main(int argc, const char* argv[])
 {
     string filename;
-    if (argc > 1)
-        filename = argv[1];
-    else {
+    size_t gc_min_threshold = GC_SIZE_THRESHOLD;
+    size_t gc_max_threshold = 0;
+    double gc_growth = GC_HEAP_GROWTH;
+    double gc_time_ratio = 0;
+    unsigned gc_pause_budget = GC_PAUSE_BUDGET_US;
+    unsigned load_threads = 0;
+    string snapshot_in, snapshot_out;
+
+    for (int i = 1; i < argc; ++i) {
+        const char* value;
+        bool ok = true;
+        if (parse_option(argv[i], "--gc-min-threshold", value))
+            ok = parse_size(value, gc_min_threshold);
+        else if (parse_option(argv[i], "--gc-max-threshold", value))
+            ok = parse_size(value, gc_max_threshold);
+        else if (parse_option(argv[i], "--gc-growth", value))
+            ok = parse_double(value, gc_growth) && gc_growth >= 1;
+        else if (parse_option(argv[i], "--gc-time-ratio", value))
+            ok = parse_double(value, gc_time_ratio) && gc_time_ratio < 1;
+        else if (parse_option(argv[i], "--gc-pause-budget", value))
+            ok = parse_unsigned(value, gc_pause_budget);
+        else if (parse_option(argv[i], "--load-threads", value))
+            ok = parse_unsigned(value, load_threads) && load_threads >= 1;
+        else if (parse_option(argv[i], "--snapshot-in", value))
+            snapshot_in = value;
+        else if (parse_option(argv[i], "--snapshot-out", value))
+            snapshot_out = value;
+        else if (argv[i][0] == '-' || !filename.empty())
+            ok = false;
+        else
+            filename = argv[i];
+
+        if (!ok) {
+            cerr << "Invalid argument: " << argv[i] << "\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (filename.empty()) {
         cerr << "Expecting a .bobc file as argument\n";
+        usage();
         return 1;
     }
 
     try {
-        BobCodeObject* bco = deserialize_bytecode(filename);
+        BobCodeObject* bco = deserialize_bytecode(filename, load_threads);
         BobVM vm;
         BobAllocator::get().set_debugging(GC_DEBUGGING);
-        vm.set_gc_size_threshold(GC_SIZE_THRESHOLD);
+        vm.set_gc_size_threshold(gc_min_threshold, gc_max_threshold);
+        vm.set_gc_heap_growth(gc_growth);
+        vm.set_gc_time_ratio(gc_time_ratio);
+        vm.set_gc_pause_budget(gc_pause_budget);
+        if (!snapshot_in.empty())
+            vm.load_snapshot(snapshot_in);
         vm.run(bco);
+        if (!snapshot_out.empty())
+            vm.save_snapshot(snapshot_out);
     }
     catch (const DeserializationError& err) {
         cerr << "Deserialization ERROR: " << err.what() << endl;
         return 1;
     }
+    catch (const SerializationError& err) {
+        cerr << "Serialization ERROR: " << err.what() << endl;
+        return 1;
+    }
     catch (const VMError& err) {
         cerr << "VM ERROR: " << err.what() << endl;
         return 1;
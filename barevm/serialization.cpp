@@ -7,14 +7,29 @@
 #include "bytecode.h"
 #include "serialization.h"
 #include "basicobjects.h"
+#include "builtins.h"
+#include "environment.h"
 #include "utils.h"
-#include <cstdio>
 #include <cassert>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
 
 const unsigned MAGIC_CONST = 0x00010B0B;
+const unsigned MAGIC_CONST_V2 = 0x00020B0B;
 
 const unsigned char SER_TYPE_NULL        = '0';
 const unsigned char SER_TYPE_BOOLEAN     = 'b';
@@ -26,55 +41,195 @@ const unsigned char SER_TYPE_INSTR       = 'i';
 const unsigned char SER_TYPE_SEQUENCE    = '[';
 const unsigned char SER_TYPE_CODEOBJECT  = 'c';
 
+// The sections of version 2 of the format. See the description of the
+// format in bob/bytecode.py.
+//
+const unsigned SECTION_STRINGS      = 1;
+const unsigned SECTION_CONSTANTS    = 2;
+const unsigned SECTION_CODEOBJECTS  = 3;
+const unsigned SECTION_REFS         = 4;
+const unsigned SECTION_CODE         = 5;
+const unsigned NUM_SECTIONS         = 6;
+
+// Stands for no code object where a code object index is expected
+//
+const unsigned NO_CODEOBJECT = ~0U;
 
-class BytecodeStream 
+// Loading with several threads is only worth it for bytecode with this many
+// code objects or more. Threads take this many code objects at a time.
+//
+const size_t PARALLEL_LOAD_MIN_CODEOBJECTS = 256;
+const size_t LOAD_CHUNK_SIZE = 16;
+
+
+// A bytecode file mapped into memory. Strings read from it refer to the
+// mapping in place, so it's never unmapped once deserialization succeeds:
+// the loaded code lives as long as the program.
+//
+class BytecodeFile
 {
 public:
-    BytecodeStream(const char* filename)
+    BytecodeFile(const char* filename)
+        : base(0), size(0), mapped(false)
     {
-        stream = fopen(filename, "rb");
-        if (!stream)
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+            throw DeserializationError("Unable to open file for deserialization");
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
             throw DeserializationError("Unable to open file for deserialization");
+        }
+        size = st.st_size;
+
+        // An empty file can't be mapped; it simply ends prematurely
+        //
+        if (size > 0) {
+            int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+            // The whole file is parsed right away, so fault it in at once
+            //
+            flags |= MAP_POPULATE;
+#endif
+            void* mem = mmap(0, size, PROT_READ, flags, fd, 0);
+            if (mem == MAP_FAILED) {
+                close(fd);
+                throw DeserializationError("Unable to map file for deserialization");
+            }
+            base = static_cast<const unsigned char*>(mem);
+            mapped = true;
+        }
+        close(fd);
+    }
+
+    const unsigned char* data() const {return base;}
+    size_t length() const {return size;}
+
+    // Keep the file mapped after this object is destroyed
+    //
+    void keep_mapped()
+    {
+        mapped = false;
     }
 
+    ~BytecodeFile()
+    {
+        if (mapped)
+            munmap(const_cast<unsigned char*>(base), size);
+    }
+private:
+    BytecodeFile(const BytecodeFile&);
+    BytecodeFile& operator=(const BytecodeFile&);
+
+    const unsigned char* base;
+    size_t size;
+    bool mapped;
+};
+
+
+// Reads a range of bytes, checking that nothing is read past its end
+//
+class BytecodeStream 
+{
+public:
+    BytecodeStream()
+        : begin(0), pos(0), end(0)
+    {}
+
+    BytecodeStream(const unsigned char* data, size_t size)
+        : begin(data), pos(data), end(data + size)
+    {}
+
     unsigned char read_byte()
     {
-        int b = fgetc(stream);
-        if (b == EOF)
-            throw DeserializationError("Stream ended prematurely");
-        return b & 0xFF;
+        require(1);
+        return *pos++;
     }
 
     unsigned read_word()
     {
         // Little endian
         //
-        unsigned word = read_byte();
-        word |= read_byte() << 8;
-        word |= read_byte() << 16;
-        word |= read_byte() << 24;
+        require(4);
+        unsigned word = pos[0] | (pos[1] << 8) | (pos[2] << 16) | (static_cast<unsigned>(pos[3]) << 24);
+        pos += 4;
         return word;
     }
 
-    string read_string(unsigned len)
+    // Reads an unsigned LEB128 integer: 7 bits per byte, least significant
+    // first, with the high bit set in all the bytes but the last.
+    //
+    unsigned read_varint()
     {
-        char* buf = new char[len + 1];
-        unsigned nread = fread(buf, 1, len, stream);
-        if (nread != len)
-            throw DeserializationError("Stream ended prematurely");
-        buf[nread] = '\0';
-        return buf;
+        unsigned value = 0;
+        for (unsigned shift = 0; shift < 32; shift += 7) {
+            unsigned char b = read_byte();
+            value |= (b & 0x7F) << shift;
+            if (b < 0x80)
+                return value;
+        }
+        throw DeserializationError("Varint too long");
+    }
+
+    StringRef read_string(unsigned len)
+    {
+        require(len);
+        StringRef str(reinterpret_cast<const char*>(pos), len);
+        pos += len;
+        return str;
+    }
+
+    // The number of bytes left to read
+    //
+    size_t remaining() const
+    {
+        return end - pos;
+    }
+
+    // The number of bytes read so far, and in all
+    //
+    size_t offset() const
+    {
+        return pos - begin;
+    }
+
+    size_t length() const
+    {
+        return end - begin;
     }
 
-    ~BytecodeStream()
+    // A stream reading size bytes from offset, counted from the beginning of
+    // this stream
+    //
+    BytecodeStream substream(size_t offset, size_t size) const
     {
-        fclose(stream);
+        if (offset > length() || size > length() - offset)
+            throw DeserializationError("Stream ended prematurely");
+        return BytecodeStream(begin + offset, size);
     }
 private:
-    FILE* stream;
+    void require(size_t len)
+    {
+        if (len > remaining())
+            throw DeserializationError("Stream ended prematurely");
+    }
+
+    const unsigned char* begin;
+    const unsigned char* pos;
+    const unsigned char* end;
 };
 
 
+// Decodes a number stored as a zigzag-encoded varint: 0, 1, 2, 3, 4...
+// stand for 0, -1, 1, -2, 2...
+//
+static int unzigzag(unsigned value)
+{
+    return static_cast<int>((value >> 1) ^ (0U - (value & 1)));
+}
+
+
 // Consumes a byte from the stream and checks if it's of the expected type
 // 
 static void match_type(BytecodeStream& stream, unsigned char type)
@@ -91,42 +246,47 @@ static BobObject* d_null(BytecodeStream& stream)
 
     // Doesn't have to read anything...
     // 
-    return new BobNull();
+    return BobNull::get();
 }
 
 
 static BobObject* d_boolean(BytecodeStream& stream)
 {
     unsigned char val = stream.read_byte();
-    return new BobBoolean(val == 1);
+    return BobBoolean::get(val == 1);
 }
 
 
 static BobObject* d_number(BytecodeStream& stream)
 {
     unsigned word = stream.read_word();
-    return new BobNumber(word);
+    return make_number(static_cast<int>(word));
 }
 
 
-static string d_string(BytecodeStream& stream)
+static StringRef d_string(BytecodeStream& stream)
 {
     unsigned len = stream.read_word();
     return stream.read_string(len);
 }
 
 
-static string d_match_string(BytecodeStream& stream)
+static StringRef d_match_string(BytecodeStream& stream)
 {
     match_type(stream, SER_TYPE_STRING);
     return d_string(stream);
 }
 
 
+static const BobAtom* d_match_atom(BytecodeStream& stream)
+{
+    return BobAtom::intern(d_match_string(stream).str());
+}
+
+
 static BobObject* d_symbol(BytecodeStream& stream)
 {
-    string str = d_string(stream);
-    return new BobSymbol(str);
+    return new BobSymbol(d_string(stream));
 }
 
 
@@ -156,14 +316,17 @@ static BobInstruction d_match_instruction(BytecodeStream& stream)
 }
 
 
-// This macro is used inside d_codeobject to avoid code duplication.
+// This macro is used inside d_codeobject to avoid code duplication. Every
+// element takes at least a byte, which bounds the space reserved for a
+// corrupt length.
 //
-#define D_MATCH_SEQUENCE(seq, d_func)               \
-    do {unsigned len, i;                            \
-        match_type(stream, SER_TYPE_SEQUENCE);      \
-        len = stream.read_word();                   \
-        for (i = 0; i < len; ++i)                   \
-            seq.push_back(d_func(stream));          \
+#define D_MATCH_SEQUENCE(seq, d_func)                      \
+    do {unsigned len, i;                                   \
+        match_type(stream, SER_TYPE_SEQUENCE);             \
+        len = stream.read_word();                          \
+        seq.reserve(min<size_t>(len, stream.remaining())); \
+        for (i = 0; i < len; ++i)                          \
+            seq.push_back(d_func(stream));                 \
         } while (0);
 
 
@@ -174,7 +337,7 @@ static BobObject* d_codeobject(BytecodeStream& stream)
 
     D_MATCH_SEQUENCE(codeobj->args, d_match_string);
     D_MATCH_SEQUENCE(codeobj->constants, d_match_object);
-    D_MATCH_SEQUENCE(codeobj->varnames, d_match_string);
+    D_MATCH_SEQUENCE(codeobj->varnames, d_match_atom);
     D_MATCH_SEQUENCE(codeobj->code, d_match_instruction);
 
     return codeobj;
@@ -209,15 +372,1105 @@ static BobObject* d_match_object(BytecodeStream& stream)
 }
 
 
-BobCodeObject* deserialize_bytecode(const string& filename)
+// Checks that an index read from a version 2 stream refers to one of size
+// elements
+//
+static unsigned check_index(unsigned index, size_t size, const char* what)
 {
-    BytecodeStream stream(filename.c_str());
+    if (index >= size)
+        throw DeserializationError(format_string("%s %u out of range", what, index));
+    return index;
+}
+
+
+static vector<StringRef> d_string_table(BytecodeStream& stream)
+{
+    unsigned count = stream.read_varint();
+    vector<StringRef> strings;
+    strings.reserve(min<size_t>(count, stream.remaining()));
+    for (unsigned i = 0; i < count; ++i) {
+        unsigned len = stream.read_varint();
+        strings.push_back(stream.read_string(len));
+    }
+    return strings;
+}
+
+
+// Checks that no code object is nested in itself, directly or through
+// others. enclosing holds the index of the code object each one is defined
+// in, or NO_CODEOBJECT.
+//
+static void check_nesting_acyclic(const vector<unsigned>& enclosing)
+{
+    // 0: not visited yet, 1: on the chain being followed, 2: known to lead
+    // out of the nesting
+    //
+    vector<unsigned char> state(enclosing.size(), 0);
+    for (unsigned i = 0; i < enclosing.size(); ++i) {
+        unsigned n = i;
+        while (n != NO_CODEOBJECT && state[n] == 0) {
+            state[n] = 1;
+            n = enclosing[n];
+        }
+        if (n != NO_CODEOBJECT && state[n] == 1)
+            throw DeserializationError(format_string("Code object %u is nested in itself", n));
+        for (n = i; n != NO_CODEOBJECT && state[n] == 1; n = enclosing[n])
+            state[n] = 2;
+    }
+}
+
+
+// Loads version 2 of the format. The whole file is checked up front,
+// recording where every constant and code object starts, but objects are
+// only created when they're first needed: the top-level code object right
+// away, the others when they're materialized (see BobCodeObject::materialize)
+// and constants when a code object that refers to them is loaded. The loader
+// must live as long as the code objects it creates.
+//
+class SectionedLoader : public BobCodeLoader
+{
+public:
+    // Reads the file from stream, which is positioned after the magic
+    // constant.
+    //
+    SectionedLoader(BytecodeStream& stream);
+
+    // Creates and loads the top-level code object
+    //
+    BobCodeObject* root_codeobject();
+
+    // Creates, loads and predecodes all the code objects with num_threads
+    // threads, and returns the top-level one
+    //
+    BobCodeObject* load_all(unsigned num_threads);
+
+    virtual void load(BobCodeObject* codeobj);
+
+    size_t num_codeobjects() const
+    {
+        return codeobjects.size();
+    }
+
+private:
+    typedef void (SectionedLoader::*CodeObjectStep)(BobCodeObject*);
+
+    struct CodeObjectEntry
+    {
+        unsigned name;
+        unsigned nargs;
+        unsigned nconstants;
+        unsigned nvarnames;
+        unsigned ncode;
+        size_t refs_offset;
+        size_t code_offset;
+    };
+
+    BobObject* constant(unsigned index);
+    BobObject* make_atom_constant(unsigned index);
+    BobCodeObject* codeobject(unsigned index);
+    const BobAtom* atom(unsigned index);
+
+    void run_step(CodeObjectStep step, unsigned num_threads);
+    void step_thread_main();
+    void load_and_link(BobCodeObject* codeobj);
+    void predecode_linked(BobCodeObject* codeobj);
+
+    BytecodeStream sections[NUM_SECTIONS];
+    vector<StringRef> strings;
+
+    // The atoms of the strings used as names of global variables, 0 until
+    // they're interned
+    //
+    vector<const BobAtom*> atoms;
+    vector<bool> is_varname;
+
+    // The constants and code objects created so far are kept to be shared
+    // by everything that refers to them; the others are 0.
+    //
+    vector<size_t> constant_offsets;
+    vector<BobObject*> constants;
+    vector<CodeObjectEntry> entries;
+    vector<BobCodeObject*> codeobjects;
+    unsigned root;
+
+    // The step load_all runs on all the code objects, the index of the next
+    // ones for a thread to take, and the first exception a thread hit
+    //
+    CodeObjectStep current_step;
+    atomic<size_t> next_codeobject;
+    exception_ptr step_error;
+    mutex step_error_lock;
+};
+
+
+SectionedLoader::SectionedLoader(BytecodeStream& stream)
+{
+    bool found[NUM_SECTIONS] = {false};
+
+    unsigned nsections = stream.read_word();
+    for (unsigned i = 0; i < nsections; ++i) {
+        unsigned id = stream.read_word();
+        unsigned offset = stream.read_word();
+        unsigned size = stream.read_word();
+
+        // Unknown sections are ignored
+        //
+        if (id < NUM_SECTIONS) {
+            sections[id] = stream.substream(offset, size);
+            found[id] = true;
+        }
+    }
+
+    for (unsigned id = SECTION_STRINGS; id < NUM_SECTIONS; ++id) {
+        if (!found[id])
+            throw DeserializationError(format_string("Section %u missing", id));
+    }
+
+    strings = d_string_table(sections[SECTION_STRINGS]);
+
+    BytecodeStream index = sections[SECTION_CODEOBJECTS];
+    unsigned ncodeobjects = index.read_varint();
+    root = check_index(index.read_varint(), ncodeobjects, "Code object");
+
+    // Every code object may be in only one constant, and every code object
+    // constant belong to only one code object, so that code objects nested
+    // in each other form a tree for predecode(). The code object of each
+    // code object constant is kept to check that the tree has no cycles.
+    //
+    BytecodeStream pool = sections[SECTION_CONSTANTS];
+    unsigned nconstants = pool.read_varint();
+    constant_offsets.reserve(min<size_t>(nconstants, pool.remaining()));
+    vector<bool> codeobject_used(ncodeobjects, false);
+    vector<unsigned> constant_codeobject;
+    constant_codeobject.reserve(constant_offsets.capacity());
+    for (unsigned i = 0; i < nconstants; ++i) {
+        constant_offsets.push_back(pool.offset());
+        unsigned char type = pool.read_byte();
+        constant_codeobject.push_back(NO_CODEOBJECT);
+
+        switch (type) {
+            case SER_TYPE_NULL:
+                break;
+            case SER_TYPE_BOOLEAN:
+                pool.read_byte();
+                break;
+            case SER_TYPE_NUMBER:
+                pool.read_varint();
+                break;
+            case SER_TYPE_SYMBOL:
+                check_index(pool.read_varint(), strings.size(), "String");
+                break;
+            case SER_TYPE_PAIR: {
+                // Elements are referred to by their distance back from the
+                // pair
+                //
+                unsigned first = pool.read_varint();
+                unsigned second = pool.read_varint();
+                if (first == 0 || first > i || second == 0 || second > i)
+                    throw DeserializationError("Pair element out of range");
+                break;
+            }
+            case SER_TYPE_CODEOBJECT: {
+                unsigned index = check_index(pool.read_varint(), ncodeobjects, "Code object");
+                if (codeobject_used[index] || index == root)
+                    throw DeserializationError(format_string("Code object %u used more than once", index));
+                codeobject_used[index] = true;
+                constant_codeobject[i] = index;
+                break;
+            }
+            default:
+                throw DeserializationError(format_string("Expected an object type, got %c", type));
+        }
+    }
+    constants.assign(nconstants, 0);
+
+    BytecodeStream refs = sections[SECTION_REFS];
+    is_varname.assign(strings.size(), false);
+    size_t code_offset = 0;
+    size_t code_length = sections[SECTION_CODE].length();
+    vector<bool> constant_used(nconstants, false);
+    vector<unsigned> enclosing(ncodeobjects, NO_CODEOBJECT);
+    entries.reserve(min<size_t>(ncodeobjects, index.remaining()));
+    for (unsigned i = 0; i < ncodeobjects; ++i) {
+        CodeObjectEntry entry;
+        entry.name = check_index(index.read_varint(), strings.size(), "String");
+        entry.nargs = index.read_varint();
+        entry.nconstants = index.read_varint();
+        entry.nvarnames = index.read_varint();
+        entry.ncode = index.read_varint();
+
+        entry.refs_offset = refs.offset();
+        for (unsigned n = 0; n < entry.nargs; ++n)
+            check_index(refs.read_varint(), strings.size(), "String");
+        for (unsigned n = 0; n < entry.nconstants; ++n) {
+            unsigned c = check_index(refs.read_varint(), nconstants, "Constant");
+            if (constant_codeobject[c] != NO_CODEOBJECT) {
+                if (constant_used[c])
+                    throw DeserializationError(format_string("Code object constant %u used more than once", c));
+                constant_used[c] = true;
+                enclosing[constant_codeobject[c]] = i;
+            }
+        }
+        for (unsigned n = 0; n < entry.nvarnames; ++n)
+            is_varname[check_index(refs.read_varint(), strings.size(), "String")] = true;
+
+        if (entry.ncode > (code_length - code_offset) / 4)
+            throw DeserializationError(format_string("Code of code object %u out of range", i));
+        entry.code_offset = code_offset;
+        code_offset += 4 * entry.ncode;
+
+        entries.push_back(entry);
+    }
+
+    // load_all links and predecodes even the code objects nothing refers
+    // to, whose enclosing scopes could otherwise loop
+    //
+    check_nesting_acyclic(enclosing);
+    codeobjects.assign(ncodeobjects, 0);
+    atoms.assign(strings.size(), 0);
+}
+
+
+BobCodeObject* SectionedLoader::root_codeobject()
+{
+    BobCodeObject* codeobj = codeobject(root);
+    load(codeobj);
+    codeobj->loader = 0;
+    return codeobj;
+}
+
+
+// The objects are created and the names interned first, by this thread
+// alone: neither the allocator nor the atom table may be used by several
+// threads. The threads then only fill in the code objects, which are
+// independent of each other: each thread loads a share of them, linking
+// every one to the code objects it defines, and once all are linked, the
+// threads predecode them.
+//
+BobCodeObject* SectionedLoader::load_all(unsigned num_threads)
+{
+    // In order, a pair's elements are created before the pair
+    //
+    for (unsigned i = 0; i < constants.size(); ++i)
+        constant(i);
+    for (unsigned i = 0; i < codeobjects.size(); ++i)
+        codeobject(i);
+    for (unsigned i = 0; i < strings.size(); ++i) {
+        if (is_varname[i])
+            atom(i);
+    }
+
+    run_step(&SectionedLoader::load_and_link, num_threads);
+    run_step(&SectionedLoader::predecode_linked, num_threads);
+    return codeobjects[root];
+}
+
+
+// Runs step on all the code objects, in this thread and num_threads - 1
+// others, each taking a chunk of code objects at a time. Rethrows the first
+// exception any of them hit.
+//
+void SectionedLoader::run_step(CodeObjectStep step, unsigned num_threads)
+{
+    current_step = step;
+    next_codeobject = 0;
+    vector<thread> threads;
+    for (unsigned i = 1; i < num_threads; ++i)
+        threads.push_back(thread(&SectionedLoader::step_thread_main, this));
+    step_thread_main();
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    if (step_error)
+        rethrow_exception(step_error);
+}
+
+
+void SectionedLoader::step_thread_main()
+{
+    try {
+        for (;;) {
+            size_t begin = next_codeobject.fetch_add(LOAD_CHUNK_SIZE);
+            if (begin >= codeobjects.size())
+                return;
+            size_t end = min(begin + LOAD_CHUNK_SIZE, codeobjects.size());
+            for (size_t i = begin; i < end; ++i)
+                (this->*current_step)(codeobjects[i]);
+        }
+    }
+    catch (...) {
+        lock_guard<mutex> lock(step_error_lock);
+        if (!step_error)
+            step_error = current_exception();
+
+        // Make the other threads stop too
+        //
+        next_codeobject = codeobjects.size();
+    }
+}
+
+
+void SectionedLoader::load_and_link(BobCodeObject* codeobj)
+{
+    load(codeobj);
+    codeobj->loader = 0;
+    codeobj->link_nested();
+}
+
+
+// Code objects that no loaded code defines are never used, and have no
+// scope to be predecoded in
+//
+void SectionedLoader::predecode_linked(BobCodeObject* codeobj)
+{
+    if (codeobj->enclosing || codeobj == codeobjects[root])
+        codeobj->predecode_alone();
+}
+
+
+void SectionedLoader::load(BobCodeObject* codeobj)
+{
+    // The file was checked when the loader was created
+    //
+    const CodeObjectEntry& entry = entries[codeobj->loader_index];
+    BytecodeStream refs = sections[SECTION_REFS];
+    refs = refs.substream(entry.refs_offset, refs.length() - entry.refs_offset);
+
+    codeobj->args.reserve(entry.nargs);
+    for (unsigned n = 0; n < entry.nargs; ++n)
+        codeobj->args.push_back(strings[refs.read_varint()]);
+    codeobj->constants.reserve(entry.nconstants);
+    for (unsigned n = 0; n < entry.nconstants; ++n)
+        codeobj->constants.push_back(constant(refs.read_varint()));
+    codeobj->varnames.reserve(entry.nvarnames);
+    for (unsigned n = 0; n < entry.nvarnames; ++n)
+        codeobj->varnames.push_back(atom(refs.read_varint()));
+
+    BytecodeStream code = sections[SECTION_CODE].substream(entry.code_offset, 4 * entry.ncode);
+    codeobj->code.reserve(entry.ncode);
+    for (unsigned n = 0; n < entry.ncode; ++n) {
+        unsigned word = code.read_word();
+        codeobj->code.push_back(BobInstruction(word >> 24, word & 0xFFFFFF));
+    }
+}
+
+
+BobObject* SectionedLoader::constant(unsigned index)
+{
+    if (constants[index])
+        return constants[index];
+
+    // A pair refers to constants before it, which have to be created first.
+    // They're tracked on an explicit stack, since the elements of a long
+    // quoted list nest too deeply for recursion.
+    //
+    const BytecodeStream& pool = sections[SECTION_CONSTANTS];
+    vector<unsigned> pending(1, index);
+    while (!pending.empty()) {
+        unsigned i = pending.back();
+        BytecodeStream stream = pool.substream(constant_offsets[i], pool.length() - constant_offsets[i]);
+        if (stream.read_byte() != SER_TYPE_PAIR) {
+            constants[i] = make_atom_constant(i);
+            pending.pop_back();
+            continue;
+        }
+
+        unsigned first = i - stream.read_varint();
+        unsigned second = i - stream.read_varint();
+        if (!constants[first])
+            pending.push_back(first);
+        else if (!constants[second])
+            pending.push_back(second);
+        else {
+            constants[i] = new BobPair(constants[first], constants[second]);
+            pending.pop_back();
+        }
+    }
+    return constants[index];
+}
+
+
+// Creates the constant at index, which isn't a pair
+//
+BobObject* SectionedLoader::make_atom_constant(unsigned index)
+{
+    const BytecodeStream& pool = sections[SECTION_CONSTANTS];
+    BytecodeStream stream = pool.substream(constant_offsets[index], pool.length() - constant_offsets[index]);
+    unsigned char type = stream.read_byte();
+
+    switch (type) {
+        case SER_TYPE_NULL:
+            return BobNull::get();
+        case SER_TYPE_BOOLEAN:
+            return BobBoolean::get(stream.read_byte() == 1);
+        case SER_TYPE_NUMBER:
+            return make_number(unzigzag(stream.read_varint()));
+        case SER_TYPE_SYMBOL:
+            return new BobSymbol(strings[stream.read_varint()]);
+        case SER_TYPE_CODEOBJECT:
+            return codeobject(stream.read_varint());
+        default:
+            assert(0 && "Unreachable");
+            return 0;
+    }
+}
 
+
+// The atom of the string at index, interned the first time
+//
+const BobAtom* SectionedLoader::atom(unsigned index)
+{
+    if (!atoms[index])
+        atoms[index] = BobAtom::intern(strings[index].str());
+    return atoms[index];
+}
+
+
+// The code object at index, created with only its name the first time
+//
+BobCodeObject* SectionedLoader::codeobject(unsigned index)
+{
+    if (!codeobjects[index]) {
+        BobCodeObject* codeobj = new BobCodeObject();
+        codeobj->name = strings[entries[index].name];
+        codeobj->loader = this;
+        codeobj->loader_index = index;
+        codeobjects[index] = codeobj;
+    }
+    return codeobjects[index];
+}
+
+
+BobCodeObject* deserialize_bytecode(const string& filename, unsigned num_threads)
+{
+    // Everything loaded lives as long as the program
+    //
+    BobPermanentScope permanent;
+    BytecodeFile file(filename.c_str());
+    BytecodeStream stream(file.data(), file.length());
+    unique_ptr<SectionedLoader> loader;
+
+    BobCodeObject* codeobj;
     unsigned magic = stream.read_word();
-    if (magic != MAGIC_CONST)
+    if (magic == MAGIC_CONST) {
+        match_type(stream, SER_TYPE_CODEOBJECT);
+        codeobj = static_cast<BobCodeObject*>(d_codeobject(stream));
+    }
+    else if (magic == MAGIC_CONST_V2) {
+        if (num_threads == 0) {
+            const char* load_threads = getenv("BOB_LOAD_THREADS");
+            num_threads = load_threads ? max(atoi(load_threads), 1) : 1;
+        }
+
+        // Loaded by a single thread, code objects are materialized as the
+        // program runs
+        //
+        loader.reset(new SectionedLoader(stream));
+        if (num_threads > 1 && loader->num_codeobjects() >= PARALLEL_LOAD_MIN_CODEOBJECTS) {
+            codeobj = loader->load_all(num_threads);
+            file.keep_mapped();
+            loader.release();
+            return codeobj;
+        }
+        codeobj = loader->root_codeobject();
+    }
+    else
         throw DeserializationError(format_string("Invalid bytecode stream (magic = 0x%0X)", magic));
 
-    match_type(stream, SER_TYPE_CODEOBJECT);
-    return static_cast<BobCodeObject*>(d_codeobject(stream));
+    codeobj->predecode();
+    file.keep_mapped();
+    loader.release();
+    return codeobj;
+}
+
+
+// A heap image ("snapshot") holds the bindings of a global environment and
+// all the objects reachable from them. Like version 2 bytecode, it's made
+// of varints, and objects refer to strings and to each other by index, so
+// it can be loaded anywhere in memory:
+//
+//   word    MAGIC_SNAPSHOT
+//   varint  number of strings, then for each: varint length, bytes
+//   varint  number of objects, then for each: type byte, varint length of
+//           the fields that follow, fields
+//   varint  number of bindings, then for each: string index of the name,
+//           reference to the value
+//
+// A reference is IMAGE_REF_NONE for no object (an unbound frame slot, the
+// environment of a closure created by top-level code), IMAGE_REF_NULL,
+// _FALSE or _TRUE, IMAGE_REF_FIXNUM followed by the zigzag-encoded value,
+// or IMAGE_REF_OBJECT plus the index of an object. The fields by type:
+//
+//   number:      zigzag-encoded value
+//   symbol:      string index
+//   pair:        first, second
+//   builtin:     string index of the name, bound to the builtin of the
+//                same name of the loading VM
+//   closure:     code object, environment
+//   frame:       parent, varint number of slots, slots
+//   code object: string index of the name, enclosing code object, then
+//                varint counts followed by the elements of the args and
+//                varnames (string indices), constants (references) and
+//                code (varint opcode and argument)
+//
+// The parent of a frame and the enclosing code object of a code object
+// come before it.
+//
+const unsigned MAGIC_SNAPSHOT = 0x00FF0B0B;
+
+const unsigned char SER_TYPE_BUILTIN     = 'B';
+const unsigned char SER_TYPE_CLOSURE     = 'C';
+const unsigned char SER_TYPE_FRAME       = 'f';
+
+const unsigned IMAGE_REF_NONE   = 0;
+const unsigned IMAGE_REF_NULL   = 1;
+const unsigned IMAGE_REF_FALSE  = 2;
+const unsigned IMAGE_REF_TRUE   = 3;
+const unsigned IMAGE_REF_FIXNUM = 4;
+const unsigned IMAGE_REF_OBJECT = 5;
+
+
+static void put_varint(string& out, unsigned value)
+{
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+
+static unsigned zigzag(int value)
+{
+    return (static_cast<unsigned>(value) << 1) ^ static_cast<unsigned>(value >> 31);
+}
+
+
+// Collects the objects reachable from the bindings of an environment and
+// writes them into an image
+//
+class SnapshotWriter
+{
+public:
+    SnapshotWriter(const BobEnvironment* env);
+
+    string image();
+private:
+    void add(BobObject* obj);
+    void scan(BobObject* obj);
+    unsigned string_index(const string& str);
+    void put_ref(string& out, BobObject* obj);
+    void put_fields(string& out, BobObject* obj);
+
+    // The bindings, sorted by name so that an image doesn't depend on the
+    // addresses of atoms
+    //
+    vector<pair<string, BobObject*> > bindings;
+
+    vector<BobObject*> objects;
+    unordered_map<const BobObject*, unsigned> indices;
+    vector<BobObject*> pending;
+
+    vector<string> strings;
+    unordered_map<string, unsigned> string_indices;
+};
+
+
+SnapshotWriter::SnapshotWriter(const BobEnvironment* env)
+{
+    const BobEnvironment::Binding& binding = env->bindings();
+    for (BobEnvironment::Binding::const_iterator i = binding.begin(); i != binding.end(); ++i)
+        bindings.push_back(make_pair(i->first->name(), i->second));
+    sort(bindings.begin(), bindings.end());
+
+    for (size_t i = 0; i < bindings.size(); ++i) {
+        add(bindings[i].second);
+        while (!pending.empty()) {
+            BobObject* obj = pending.back();
+            pending.pop_back();
+            scan(obj);
+        }
+    }
+}
+
+
+// Gives obj an index if it needs one and has none yet, after the frame or
+// code object it's nested in
+//
+void SnapshotWriter::add(BobObject* obj)
+{
+    if (!obj || is_fixnum(obj) || is<BobNull>(obj) || is<BobBoolean>(obj) || indices.count(obj))
+        return;
+
+    if (BobFrame* frame = object_cast<BobFrame>(obj))
+        add(frame->parent());
+    else if (BobCodeObject* codeobj = object_cast<BobCodeObject>(obj))
+        add(codeobj->enclosing);
+
+    indices[obj] = objects.size();
+    objects.push_back(obj);
+    pending.push_back(obj);
+}
+
+
+void SnapshotWriter::scan(BobObject* obj)
+{
+    switch (obj->type()) {
+        case TYPE_NUMBER:
+        case TYPE_SYMBOL:
+        case TYPE_BUILTIN_PROCEDURE:
+            break;
+        case TYPE_PAIR: {
+            BobPair* pair = as<BobPair>(obj);
+            add(pair->first());
+            add(pair->second());
+            break;
+        }
+        case TYPE_CLOSURE: {
+            BobClosure* closure = as<BobClosure>(obj);
+            add(closure->codeobject);
+            add(closure->env);
+            break;
+        }
+        case TYPE_FRAME: {
+            BobFrame* frame = as<BobFrame>(obj);
+            for (unsigned i = 0; i < frame->size(); ++i)
+                add(frame->slot(i));
+            break;
+        }
+        case TYPE_CODE_OBJECT: {
+            // The image has no bytecode file to load the code from later
+            //
+            BobCodeObject* codeobj = as<BobCodeObject>(obj);
+            if (!codeobj->is_materialized())
+                codeobj->materialize();
+            for (size_t i = 0; i < codeobj->constants.size(); ++i)
+                add(codeobj->constants[i]);
+            break;
+        }
+        default:
+            throw SerializationError(format_string("Can't save a %s in a heap image", type_name(obj->type())));
+    }
+}
+
+
+unsigned SnapshotWriter::string_index(const string& str)
+{
+    unordered_map<string, unsigned>::const_iterator i = string_indices.find(str);
+    if (i != string_indices.end())
+        return i->second;
+    string_indices[str] = strings.size();
+    strings.push_back(str);
+    return strings.size() - 1;
+}
+
+
+void SnapshotWriter::put_ref(string& out, BobObject* obj)
+{
+    if (!obj)
+        put_varint(out, IMAGE_REF_NONE);
+    else if (is_fixnum(obj)) {
+        put_varint(out, IMAGE_REF_FIXNUM);
+        put_varint(out, zigzag(static_cast<int>(fixnum_value(obj))));
+    }
+    else if (is<BobNull>(obj))
+        put_varint(out, IMAGE_REF_NULL);
+    else if (is<BobBoolean>(obj))
+        put_varint(out, as<BobBoolean>(obj)->value() ? IMAGE_REF_TRUE : IMAGE_REF_FALSE);
+    else
+        put_varint(out, IMAGE_REF_OBJECT + indices[obj]);
+}
+
+
+void SnapshotWriter::put_fields(string& out, BobObject* obj)
+{
+    switch (obj->type()) {
+        case TYPE_NUMBER:
+            put_varint(out, zigzag(as<BobNumber>(obj)->value()));
+            break;
+        case TYPE_SYMBOL:
+            put_varint(out, string_index(obj->repr()));
+            break;
+        case TYPE_BUILTIN_PROCEDURE:
+            put_varint(out, string_index(as<BobBuiltinProcedure>(obj)->name()));
+            break;
+        case TYPE_PAIR: {
+            BobPair* pair = as<BobPair>(obj);
+            put_ref(out, pair->first());
+            put_ref(out, pair->second());
+            break;
+        }
+        case TYPE_CLOSURE: {
+            BobClosure* closure = as<BobClosure>(obj);
+            put_ref(out, closure->codeobject);
+            put_ref(out, closure->env);
+            break;
+        }
+        case TYPE_FRAME: {
+            BobFrame* frame = as<BobFrame>(obj);
+            put_ref(out, frame->parent());
+            put_varint(out, frame->size());
+            for (unsigned i = 0; i < frame->size(); ++i)
+                put_ref(out, frame->slot(i));
+            break;
+        }
+        case TYPE_CODE_OBJECT: {
+            BobCodeObject* codeobj = as<BobCodeObject>(obj);
+            put_varint(out, string_index(codeobj->name.str()));
+            put_ref(out, codeobj->enclosing);
+            put_varint(out, codeobj->args.size());
+            for (size_t i = 0; i < codeobj->args.size(); ++i)
+                put_varint(out, string_index(codeobj->args[i].str()));
+            put_varint(out, codeobj->varnames.size());
+            for (size_t i = 0; i < codeobj->varnames.size(); ++i)
+                put_varint(out, string_index(codeobj->varnames[i]->name()));
+            put_varint(out, codeobj->constants.size());
+            for (size_t i = 0; i < codeobj->constants.size(); ++i)
+                put_ref(out, codeobj->constants[i]);
+            put_varint(out, codeobj->code.size());
+            for (size_t i = 0; i < codeobj->code.size(); ++i) {
+                put_varint(out, codeobj->code[i].opcode);
+                put_varint(out, codeobj->code[i].arg);
+            }
+            break;
+        }
+        default:
+            assert(0 && "Unexpected object in heap image");
+    }
+}
+
+
+string SnapshotWriter::image()
+{
+    // The strings are collected while writing the objects and bindings,
+    // which come after them
+    //
+    static const unsigned char types[NUM_TYPES] = {
+        0, 0, SER_TYPE_NUMBER, SER_TYPE_SYMBOL, SER_TYPE_PAIR, SER_TYPE_BUILTIN,
+        SER_TYPE_CLOSURE, SER_TYPE_CODEOBJECT, 0, SER_TYPE_FRAME, 0};
+
+    string body;
+    put_varint(body, objects.size());
+    string fields;
+    for (size_t i = 0; i < objects.size(); ++i) {
+        fields.clear();
+        put_fields(fields, objects[i]);
+        body += static_cast<char>(types[objects[i]->type()]);
+        put_varint(body, fields.size());
+        body += fields;
+    }
+
+    put_varint(body, bindings.size());
+    for (size_t i = 0; i < bindings.size(); ++i) {
+        put_varint(body, string_index(bindings[i].first));
+        put_ref(body, bindings[i].second);
+    }
+
+    string image;
+    for (unsigned shift = 0; shift < 32; shift += 8)
+        image += static_cast<char>((MAGIC_SNAPSHOT >> shift) & 0xFF);
+    put_varint(image, strings.size());
+    for (size_t i = 0; i < strings.size(); ++i) {
+        put_varint(image, strings[i].size());
+        image += strings[i];
+    }
+    return image + body;
+}
+
+
+void serialize_snapshot(const string& filename, const BobEnvironment* env)
+{
+    string image = SnapshotWriter(env).image();
+
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file)
+        throw SerializationError("Unable to open file for the heap image: " + filename);
+    bool written = fwrite(image.data(), 1, image.size(), file) == image.size();
+    if (fclose(file) != 0 || !written)
+        throw SerializationError("Unable to write the heap image: " + filename);
 }
 
+
+// Loads an image in two passes over its objects: the first creates them,
+// and the second fills in the references between them, which may form
+// cycles. The code objects are then predecoded, and only once the whole
+// image is checked are its bindings added to the environment.
+//
+class SnapshotReader
+{
+public:
+    // Reads the image from stream, which is positioned after the magic
+    // constant. Builtins are looked up in env, which the bindings are
+    // added to.
+    //
+    SnapshotReader(BytecodeStream& stream, BobEnvironment* env);
+
+    void read();
+private:
+    BobObject* create_object(unsigned char type, BytecodeStream& fields);
+    void link_object(unsigned char type, unsigned index, BytecodeStream& fields);
+    void check_closure(const BobClosure* closure);
+
+    const StringRef& string_at(unsigned index)
+    {
+        return strings[check_index(index, strings.size(), "String")];
+    }
+
+    // A reference to a value, or to one of the first limit objects. 0 for
+    // IMAGE_REF_NONE.
+    //
+    BobObject* d_ref(BytecodeStream& fields, size_t limit);
+    BobObject* d_value(BytecodeStream& fields);
+
+    template <class T>
+    T* d_ref_to(BytecodeStream& fields, size_t limit)
+    {
+        BobObject* obj = d_ref(fields, limit);
+        if (obj && !is<T>(obj))
+            throw DeserializationError(format_string("Expected a %s in heap image", type_name(T::type_tag)));
+        return static_cast<T*>(obj);
+    }
+
+    BytecodeStream& stream;
+    BobEnvironment* env;
+    vector<StringRef> strings;
+    vector<BobObject*> objects;
+    vector<BobCodeObject*> codeobjects;
+    vector<BobCodeObject*> enclosing;
+    vector<BobClosure*> closures;
+};
+
+
+SnapshotReader::SnapshotReader(BytecodeStream& stream_, BobEnvironment* env_)
+    : stream(stream_), env(env_)
+{
+}
+
+
+void SnapshotReader::read()
+{
+    strings = d_string_table(stream);
+
+    unsigned count = stream.read_varint();
+    objects.reserve(min<size_t>(count, stream.remaining()));
+    size_t objects_offset = stream.offset();
+    for (unsigned i = 0; i < count; ++i) {
+        unsigned char type = stream.read_byte();
+        unsigned len = stream.read_varint();
+        BytecodeStream fields = stream.substream(stream.offset(), len);
+        stream.read_string(len);
+        objects.push_back(create_object(type, fields));
+    }
+
+    BytecodeStream records = stream.substream(objects_offset, stream.offset() - objects_offset);
+    for (unsigned i = 0; i < count; ++i) {
+        unsigned char type = records.read_byte();
+        unsigned len = records.read_varint();
+        BytecodeStream fields = records.substream(records.offset(), len);
+        records.read_string(len);
+        link_object(type, i, fields);
+        if (fields.remaining() != 0)
+            throw DeserializationError(format_string("Invalid heap image object %u", i));
+    }
+
+    // Every code object must be nested in the one the image says, so that
+    // the chains of enclosing code objects end
+    //
+    for (size_t i = 0; i < codeobjects.size(); ++i)
+        codeobjects[i]->link_nested();
+    for (size_t i = 0; i < codeobjects.size(); ++i) {
+        if (codeobjects[i]->enclosing != enclosing[i])
+            throw DeserializationError("Inconsistent nesting of code objects in heap image");
+    }
+    for (size_t i = 0; i < codeobjects.size(); ++i)
+        codeobjects[i]->predecode_alone();
+    for (size_t i = 0; i < closures.size(); ++i)
+        check_closure(closures[i]);
+
+    unsigned nbindings = stream.read_varint();
+    vector<pair<const BobAtom*, BobObject*> > bindings;
+    bindings.reserve(min<size_t>(nbindings, stream.remaining()));
+    for (unsigned i = 0; i < nbindings; ++i) {
+        const BobAtom* name = BobAtom::intern(string_at(stream.read_varint()).str());
+        bindings.push_back(make_pair(name, d_value(stream)));
+    }
+    if (stream.remaining() != 0)
+        throw DeserializationError("Invalid heap image (trailing data)");
+
+    for (size_t i = 0; i < bindings.size(); ++i)
+        env->define_var(bindings[i].first, bindings[i].second);
+}
+
+
+// Creates an object from the fields it doesn't need other objects for,
+// except for the parent of a frame, which comes before it
+//
+BobObject* SnapshotReader::create_object(unsigned char type, BytecodeStream& fields)
+{
+    switch (type) {
+        case SER_TYPE_NUMBER:
+            return new BobNumber(unzigzag(fields.read_varint()));
+        case SER_TYPE_SYMBOL:
+            return new BobSymbol(string_at(fields.read_varint()));
+        case SER_TYPE_BUILTIN: {
+            const StringRef& name = string_at(fields.read_varint());
+            BobObject* builtin = env->lookup_var(BobAtom::intern(name.str()));
+            if (!builtin || !is<BobBuiltinProcedure>(builtin) ||
+                as<BobBuiltinProcedure>(builtin)->name() != name.str())
+                throw DeserializationError("Unknown builtin in heap image: " + name.str());
+            return builtin;
+        }
+        case SER_TYPE_PAIR:
+            return new BobPair(BobNull::get(), BobNull::get());
+        case SER_TYPE_CLOSURE:
+            return new BobClosure(0, 0);
+        case SER_TYPE_FRAME: {
+            BobFrame* parent = d_ref_to<BobFrame>(fields, objects.size());
+            unsigned size = fields.read_varint();
+
+            // Every slot takes at least a byte
+            //
+            if (size > fields.remaining())
+                throw DeserializationError("Frame size out of range in heap image");
+            return BobFrame::create(parent, size);
+        }
+        case SER_TYPE_CODEOBJECT: {
+            BobCodeObject* codeobj = new BobCodeObject();
+            codeobj->name = string_at(fields.read_varint());
+            return codeobj;
+        }
+        default:
+            throw DeserializationError(format_string("Expected an object type, got %c", type));
+    }
+}
+
+
+// Reads the fields of the object at index again, filling in its
+// references
+//
+void SnapshotReader::link_object(unsigned char type, unsigned index, BytecodeStream& fields)
+{
+    BobObject* obj = objects[index];
+    switch (type) {
+        case SER_TYPE_NUMBER:
+        case SER_TYPE_SYMBOL:
+        case SER_TYPE_BUILTIN:
+            fields.read_varint();
+            break;
+        case SER_TYPE_PAIR: {
+            BobPair* pair = as<BobPair>(obj);
+            pair->set_first(d_value(fields));
+            pair->set_second(d_value(fields));
+            break;
+        }
+        case SER_TYPE_CLOSURE: {
+            BobClosure* closure = as<BobClosure>(obj);
+            closure->codeobject = d_ref_to<BobCodeObject>(fields, objects.size());
+            if (!closure->codeobject)
+                throw DeserializationError("Expected a codeobject in heap image");
+            closure->env = d_ref_to<BobFrame>(fields, objects.size());
+            closures.push_back(closure);
+            break;
+        }
+        case SER_TYPE_FRAME: {
+            BobFrame* frame = as<BobFrame>(obj);
+            d_ref(fields, objects.size());
+            fields.read_varint();
+            for (unsigned i = 0; i < frame->size(); ++i)
+                frame->set_slot(i, d_ref(fields, objects.size()));
+            break;
+        }
+        case SER_TYPE_CODEOBJECT: {
+            BobCodeObject* codeobj = as<BobCodeObject>(obj);
+            fields.read_varint();
+            codeobjects.push_back(codeobj);
+            enclosing.push_back(d_ref_to<BobCodeObject>(fields, index));
+
+            unsigned len = fields.read_varint();
+            codeobj->args.reserve(min<size_t>(len, fields.remaining()));
+            for (unsigned i = 0; i < len; ++i)
+                codeobj->args.push_back(string_at(fields.read_varint()));
+
+            len = fields.read_varint();
+            codeobj->varnames.reserve(min<size_t>(len, fields.remaining()));
+            for (unsigned i = 0; i < len; ++i)
+                codeobj->varnames.push_back(BobAtom::intern(string_at(fields.read_varint()).str()));
+
+            len = fields.read_varint();
+            codeobj->constants.reserve(min<size_t>(len, fields.remaining()));
+            for (unsigned i = 0; i < len; ++i)
+                codeobj->constants.push_back(d_value(fields));
+
+            len = fields.read_varint();
+            codeobj->code.reserve(min<size_t>(len, fields.remaining() / 2));
+            for (unsigned i = 0; i < len; ++i) {
+                unsigned opcode = fields.read_varint();
+                codeobj->code.push_back(BobInstruction(opcode, fields.read_varint()));
+            }
+            break;
+        }
+        default:
+            assert(0 && "Unreachable");
+    }
+}
+
+
+// A closure is called with its environment as the parent of the new
+// frame, so the frames of the environment must be at least as large as
+// the code expects those of the enclosing procedures to be
+//
+void SnapshotReader::check_closure(const BobClosure* closure)
+{
+    const BobFrame* frame = closure->env;
+    for (const BobCodeObject* outer = closure->codeobject->enclosing; outer && outer->enclosing; outer = outer->enclosing) {
+        if (!frame || frame->size() < outer->frame_size)
+            throw DeserializationError("Closure environment doesn't match its code in heap image");
+        frame = frame->parent();
+    }
+}
+
+
+BobObject* SnapshotReader::d_ref(BytecodeStream& fields, size_t limit)
+{
+    unsigned ref = fields.read_varint();
+    switch (ref) {
+        case IMAGE_REF_NONE:
+            return 0;
+        case IMAGE_REF_NULL:
+            return BobNull::get();
+        case IMAGE_REF_FALSE:
+            return BobBoolean::get(false);
+        case IMAGE_REF_TRUE:
+            return BobBoolean::get(true);
+        case IMAGE_REF_FIXNUM:
+            return make_number(unzigzag(fields.read_varint()));
+        default:
+            return objects[check_index(ref - IMAGE_REF_OBJECT, limit, "Object")];
+    }
+}
+
+
+BobObject* SnapshotReader::d_value(BytecodeStream& fields)
+{
+    BobObject* obj = d_ref(fields, objects.size());
+    if (!obj)
+        throw DeserializationError("Missing value in heap image");
+    return obj;
+}
+
+
+void deserialize_snapshot(const string& filename, BobEnvironment* env)
+{
+    BytecodeFile file(filename.c_str());
+    BytecodeStream stream(file.data(), file.length());
+    unsigned magic = stream.read_word();
+    if (magic != MAGIC_SNAPSHOT)
+        throw DeserializationError(format_string("Invalid heap image (magic = 0x%0X)", magic));
+
+    // Like the objects loaded from bytecode, those of an image are meant to
+    // live as long as the program
+    //
+    BobPermanentScope permanent;
+    SnapshotReader(stream, env).read();
+    file.keep_mapped();
+}
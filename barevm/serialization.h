@@ -21,11 +21,39 @@ struct DeserializationError : public std::runtime_error
 };
 
 
+// The exception type thrown when a heap image can't be saved
+//
+struct SerializationError : public std::runtime_error
+{
+    SerializationError(const std::string& reason)
+        : std::runtime_error(reason)
+    {}
+};
+
+
 class BobCodeObject;
+class BobEnvironment;
+
+
+// Given a bytecode file, deserializes it into a new BobCodeObject, ready
+// for execution (predecoded).
+//
+// Code objects of a version 2 bytecode are loaded as they're first called,
+// unless num_threads is more than 1: all of them are then loaded up front,
+// in parallel. 0 takes the number of threads from the BOB_LOAD_THREADS
+// environment variable, or 1 if it isn't set.
+//
+BobCodeObject* deserialize_bytecode(const std::string& filename, unsigned num_threads = 0);
 
+// Saves the bindings of env and all the objects reachable from them into a
+// heap image file. Code objects that weren't loaded yet are loaded first.
+//
+void serialize_snapshot(const std::string& filename, const BobEnvironment* env);
 
-// Given a bytecode file, deserializes it into a new BobCodeObject
+// Loads a heap image file saved by serialize_snapshot, adding its bindings
+// to env. The builtins the image refers to are those bound to the same
+// names in env, so it must be loaded before any of them is redefined.
 //
-BobCodeObject* deserialize_bytecode(const std::string& filename); 
+void deserialize_snapshot(const std::string& filename, BobEnvironment* env);
 
 #endif /* SERIALIZATION_H */
@@ -9,6 +9,7 @@
 
 #include <string>
 #include <sstream>
+#include <cstring>
 
 
 // Convert some value to a string. This value must be of a class that supports
@@ -27,4 +28,42 @@ std::string value_to_string(const T& value)
 //
 std::string format_string(const char* format, ...);
 
+
+// A reference to characters stored elsewhere, which must outlive it. The
+// characters aren't NUL-terminated; use str() to get a std::string.
+//
+class StringRef
+{
+public:
+    StringRef()
+        : m_data(0), m_size(0)
+    {}
+
+    StringRef(const char* data, size_t size)
+        : m_data(data), m_size(size)
+    {}
+
+    const char* data() const {return m_data;}
+    size_t size() const {return m_size;}
+
+    std::string str() const
+    {
+        return std::string(m_data, m_size);
+    }
+
+    bool operator==(const StringRef& other) const
+    {
+        return m_size == other.m_size && std::memcmp(m_data, other.m_data, m_size) == 0;
+    }
+
+    bool operator!=(const StringRef& other) const
+    {
+        return !(*this == other);
+    }
+
+private:
+    const char* m_data;
+    size_t m_size;
+};
+
 #endif /* UTILS_H */
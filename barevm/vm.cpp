@@ -10,62 +10,66 @@
 #include "environment.h"
 #include "builtins.h"
 #include "basicobjects.h"
+#include "serialization.h"
 #include <stack>
 #include <deque>
 #include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <cassert>
 #include <iostream>
-#include <typeinfo>
 
 using namespace std;
 
 
+// The VM loop dispatches instructions with GCC's "labels as values"
+// extension when the compiler supports it (GCC and Clang do): every
+// instruction handler jumps straight to the handler of the next
+// instruction. Otherwise, or when BOB_NO_COMPUTED_GOTO is defined at build
+// time, a portable switch inside a loop is used.
+//
+#if defined(__GNUC__) && !defined(BOB_NO_COMPUTED_GOTO)
+#define BOB_USE_COMPUTED_GOTO 1
+#else
+#define BOB_USE_COMPUTED_GOTO 0
+#endif
+
+
 // Encapsulates the VM state - "execution frame". The frame consists of the
-// current code object being executed, the pc (program counter) offset into
-// it to know which instruction is next to execute, and the current
-// environment in which the code object is being executed.
+// current code object being executed, the pc (program counter) pointing
+// into its executable stream to know which instruction is next to execute,
+// and the current environment in which the code object is being executed:
+// the procedure frame holding its local variables (0 for top-level code).
 //
 struct ExecutionFrame
 {
     BobCodeObject* codeobject;
-    unsigned pc;
-    BobEnvironment* env;
+    const BobExecInstruction* pc;
+    BobFrame* env;
 
     string repr()
     {
-        return format_string("Code: <%s> [PC=%d]", codeobject->name.c_str(), pc);
+        return format_string("Code: <%s> [PC=%d]", codeobject->name.str().c_str(),
+                             static_cast<int>(pc - codeobject->exec_code.data()));
     }
 };
 
 
-// A closure is a code object (procedure) with an associated environment
-// in which the closure was created.
+// Find the binding cell of a global variable reference in env through its
+// inline cache, filling the cache on a miss. Return 0 if the variable isn't
+// bound.
 //
-class BobClosure : public BobObject
+static inline BobObject** global_cell(BobEnvironment* env, BobGlobalCache* cache)
 {
-public:
-    BobClosure(BobCodeObject* codeobject_, BobEnvironment* env_)
-        : codeobject(codeobject_), env(env_)
-    {}
-
-    virtual ~BobClosure()
-    {}
-
-    virtual string repr() const
-    {
-        return format_string("<closure '%s'>", codeobject->name.c_str());
+    if (cache->env != env || cache->generation != BobEnvironment::binding_generation()) {
+        cache->cell = env->lookup_cell(cache->atom);
+        if (!cache->cell)
+            return 0;
+        cache->env = env;
+        cache->generation = BobEnvironment::binding_generation();
     }
-
-    BobCodeObject* codeobject;
-    BobEnvironment* env;
-
-    virtual void gc_mark_pointed()
-    {
-        codeobject->gc_mark();
-        env->gc_mark();
-    }
-};
+    return cache->cell;
+}
 
 
 struct VMImpl
@@ -81,24 +85,34 @@ struct VMImpl
     //
     deque<ExecutionFrame> m_framestack;
 
-    // Stack for everything else
+    // Stack for everything else. This one is a vector<>, because procedure
+    // arguments are passed to builtins in place, which needs contiguous
+    // storage.
     //
-    deque<BobObject*> m_valuestack;
+    vector<BobObject*> m_valuestack;
 
     // The current execution frame
     //
     ExecutionFrame m_frame;
 
-    size_t gc_size_threshold;
+    // The global environment, where top-level definitions and builtins live
+    //
+    BobEnvironment* m_global_env;
+
+    // The builtins that OP_ADD..OP_GE stand for, as created in the global
+    // environment, indexed by opcode - OP_ADD. These instructions compute
+    // the result directly as long as the builtin is still bound to its name.
+    //
+    BobObject* m_binary_op_builtins[OP_GE - OP_ADD + 1];
 
     //---------------------------------------------------------------
 
     // Builtins with access to VM state
     //
-    BobObject* builtin_write(BuiltinArgs&);
-    BobObject* builtin_debug_vm(BuiltinArgs&);
-    BobObject* builtin_run_gc(BuiltinArgs&);
-    BobObject* builtin_debug_gc(BuiltinArgs&);
+    BobObject* builtin_write(const BuiltinArgs&);
+    BobObject* builtin_debug_vm(const BuiltinArgs&);
+    BobObject* builtin_run_gc(const BuiltinArgs&);
+    BobObject* builtin_debug_gc(const BuiltinArgs&);
 
     // Internal
     //
@@ -123,11 +137,16 @@ BobVM::BobVM(const string& output_file)
 
     d->m_frame.codeobject = 0;
     d->m_frame.pc = 0;
-    d->m_frame.env = d->create_global_env();
+    d->m_frame.env = 0;
+    d->m_global_env = d->create_global_env();
 
-    // Default GC size threshold
+    // The number of GC marking threads and compaction can be set from the
+    // environment
     //
-    d->gc_size_threshold = 10 * 1024 * 1024;
+    if (const char* gc_threads = getenv("BOB_GC_THREADS"))
+        set_gc_threads(static_cast<unsigned>(atoi(gc_threads)));
+    if (const char* gc_compact = getenv("BOB_GC_COMPACT"))
+        set_gc_compacting(atoi(gc_compact) != 0);
 
     BobAllocator::get().register_vm_obj(this);
 }
@@ -135,15 +154,58 @@ BobVM::BobVM(const string& output_file)
 
 BobVM::~BobVM()
 {
+    BobAllocator::get().register_vm_obj(0);
     if (d->m_output_stream != stdout)
         fclose(d->m_output_stream);
     delete d;
 }
 
 
-void BobVM::set_gc_size_threshold(size_t threshold)
+void BobVM::save_snapshot(const string& filename)
+{
+    serialize_snapshot(filename, d->m_global_env);
+}
+
+
+void BobVM::load_snapshot(const string& filename)
 {
-    d->gc_size_threshold = threshold;
+    deserialize_snapshot(filename, d->m_global_env);
+}
+
+
+void BobVM::set_gc_size_threshold(size_t min_threshold, size_t max_threshold)
+{
+    BobAllocator::get().set_size_threshold(min_threshold, max_threshold);
+}
+
+
+void BobVM::set_gc_heap_growth(double heap_growth)
+{
+    BobAllocator::get().set_heap_growth(heap_growth);
+}
+
+
+void BobVM::set_gc_time_ratio(double ratio)
+{
+    BobAllocator::get().set_gc_time_ratio(ratio);
+}
+
+
+void BobVM::set_gc_pause_budget(unsigned budget_us)
+{
+    BobAllocator::get().set_pause_budget(budget_us);
+}
+
+
+void BobVM::set_gc_threads(unsigned num_threads)
+{
+    BobAllocator::get().set_mark_threads(num_threads);
+}
+
+
+void BobVM::set_gc_compacting(bool compacting)
+{
+    BobAllocator::get().set_compacting(compacting);
 }
 
 
@@ -152,218 +214,366 @@ void BobVM::run(BobCodeObject* codeobj)
     if (!codeobj)
         return;
 
+    if (codeobj->exec_code.empty())
+        codeobj->predecode();
+
     d->m_frame.codeobject = codeobj;
-    d->m_frame.pc = 0;
+    d->m_frame.pc = codeobj->exec_code.data();
 
-    // The big VM loop!
+    // Registers of the VM loop: the next instruction to execute and the
+    // instruction being executed. The pc is written back into m_frame only
+    // when the frame is saved on the frame stack, and ip is reloaded from
+    // m_frame whenever the current frame changes.
     //
-    while (true) {
-        BobCodeObject* cur_codeobj = d->m_frame.codeobject;
+    const BobExecInstruction* ip = d->m_frame.pc;
+    const BobExecInstruction* instr = 0;
 
-        // Get the next instruction from the current code object. If there's
-        // no more instructions, this must be a top-level codeobject, in
-        // which case the program is done.
-        //
-        BobInstruction instr;
-        if (d->m_frame.pc >= cur_codeobj->code.size()) {
-            if (d->m_framestack.size() == 0)
-                return;
-            else
-                throw VMError("Code object ended prematurely");
-        }
-        else {
-            instr = cur_codeobj->code[d->m_frame.pc];
-            d->m_frame.pc++;
-        }
+    // Get the next instruction from the current code object. Every
+    // executable stream ends with OP_END, so no bounds check is needed here.
+    //
+    // The GC runs from the allocations instructions make, so every object
+    // an instruction holds across an allocation must be reachable from the
+    // roots: it stays on the value stack, or is rooted with a BobRoot.
+    // Builtins see their arguments in place on the value stack. Collections
+    // that move objects wait for a safepoint, at calls and backward jumps,
+    // where the VM holds no objects outside its roots.
+    //
+#define VM_FETCH()                                                  \
+    do {                                                            \
+        instr = ip++;                                               \
+    } while (0)
+
+#if BOB_USE_COMPUTED_GOTO
+    // Each handler ends by fetching the next instruction and jumping
+    // directly to its handler through this table, so there's no central
+    // dispatch point for the branch predictor to trip over.
+    //
+    static void* dispatch_table[256];
+    static bool dispatch_table_ready = false;
+    if (!dispatch_table_ready) {
+        for (unsigned i = 0; i < 256; ++i)
+            dispatch_table[i] = __extension__ &&target_invalid;
+        dispatch_table[OP_CONST] = __extension__ &&target_OP_CONST;
+        dispatch_table[OP_LOADVAR] = __extension__ &&target_OP_LOADVAR;
+        dispatch_table[OP_STOREVAR] = __extension__ &&target_OP_STOREVAR;
+        dispatch_table[OP_DEFVAR] = __extension__ &&target_OP_DEFVAR;
+        dispatch_table[OP_LOADLOCAL] = __extension__ &&target_OP_LOADLOCAL;
+        dispatch_table[OP_STORELOCAL] = __extension__ &&target_OP_STORELOCAL;
+        dispatch_table[OP_FUNCTION] = __extension__ &&target_OP_FUNCTION;
+        dispatch_table[OP_POP] = __extension__ &&target_OP_POP;
+        dispatch_table[OP_JUMP] = __extension__ &&target_OP_JUMP;
+        dispatch_table[OP_FJUMP] = __extension__ &&target_OP_FJUMP;
+        dispatch_table[OP_RETURN] = __extension__ &&target_OP_RETURN;
+        dispatch_table[OP_CALL] = __extension__ &&target_OP_CALL;
+        dispatch_table[OP_TAILCALL] = __extension__ &&target_OP_TAILCALL;
+        dispatch_table[OP_ADD] = __extension__ &&target_OP_ADD;
+        dispatch_table[OP_SUB] = __extension__ &&target_OP_SUB;
+        dispatch_table[OP_MUL] = __extension__ &&target_OP_MUL;
+        dispatch_table[OP_NUMEQ] = __extension__ &&target_OP_NUMEQ;
+        dispatch_table[OP_LT] = __extension__ &&target_OP_LT;
+        dispatch_table[OP_GT] = __extension__ &&target_OP_GT;
+        dispatch_table[OP_LE] = __extension__ &&target_OP_LE;
+        dispatch_table[OP_GE] = __extension__ &&target_OP_GE;
+        dispatch_table[OP_END] = __extension__ &&target_OP_END;
+        dispatch_table_ready = true;
+    }
 
-        // Let the GC run if required.
-        // Note: it's important to allow the GC to run only in-between
-        // instructions, because during an instruction's execution, some
-        // objects may not be reachable from the roots and the GC will
-        // collect them if run. One example is builtin calls, where the
-        // arguments are taken off the stack before passing control to
-        // the builtin. If the builtin triggered a GC call, these arguments
-        // would be collected which is a very bad thing. So, for extra
-        // safety, GC is not allowed to run arbitrarily.
-        //
-        BobAllocator::get().run_gc(d->gc_size_threshold);
+#define VM_TARGET(op)   target_##op: case op
+#define VM_DISPATCH()                                               \
+    do {                                                            \
+        VM_FETCH();                                                 \
+        __extension__ ({goto *dispatch_table[instr->opcode & 0xFF];}); \
+    } while (0)
+#else
+#define VM_TARGET(op)   case op
+#define VM_DISPATCH()   continue
+#endif
+
+    // The procedure call in progress: set up by OP_CALL and OP_TAILCALL, and
+    // by the binary operation instructions when they fall back to calling
+    // the procedure bound to their operator's name.
+    //
+    BobObject* call_func = 0;
+    unsigned call_argcount = 0;
+    bool call_tail = false;
 
-        switch (instr.opcode) {
-            case OP_CONST:
+    // The function is taken off the value stack before its frame is
+    // allocated
+    //
+    BobRoot call_func_root(call_func);
+
+    // The binary arithmetic and comparison instructions. If the operator's
+    // name is still bound to the original builtin and both operands on the
+    // stack are numbers, the result replaces them. Otherwise this is a call
+    // of whatever is bound to the name, which also reports type errors. It's
+    // a tail call when the code returns right after the instruction.
+    //
+#define VM_BINARY_OP(op, expr)                                      \
+            VM_TARGET(op):                                          \
+            {                                                       \
+                BobObject** cell = global_cell(d->m_global_env, instr->global); \
+                if (!cell)                                          \
+                    throw VMError(format_string("Unknown variable '%s' referenced", instr->global->atom->name().c_str())); \
+                assert(d->m_valuestack.size() >= 2 && "Binary operation needs two values on valuestack"); \
+                BobObject* lhs = d->m_valuestack[d->m_valuestack.size() - 2]; \
+                BobObject* rhs = d->m_valuestack.back();            \
+                if (*cell == d->m_binary_op_builtins[op - OP_ADD] && \
+                    is_fixnum(lhs) && is_fixnum(rhs)) {             \
+                    int a = number_value(lhs);                      \
+                    int b = number_value(rhs);                      \
+                    d->m_valuestack.pop_back();                     \
+                    d->m_valuestack.back() = (expr);                \
+                    VM_DISPATCH();                                  \
+                }                                                   \
+                call_func = *cell;                                  \
+                call_argcount = 2;                                  \
+                call_tail = instr->tail;                            \
+                goto do_call;                                       \
+            }
+
+    // The big VM loop!
+    //
+    while (true) {
+        VM_FETCH();
+
+        switch (instr->opcode) {
+            VM_TARGET(OP_CONST):
             {
-                assert(instr.arg < cur_codeobj->constants.size() && "Constants offset in bounds");
-                BobObject* val = cur_codeobj->constants[instr.arg];
-                //cerr << "OP_CONST The repr of val on stack is " << val->repr() << endl;
-                d->m_valuestack.push_back(val);
-                break;
+                d->m_valuestack.push_back(instr->constant);
+                VM_DISPATCH();
             }
-            case OP_LOADVAR:
+            VM_TARGET(OP_LOADVAR):
             {
-                assert(instr.arg < cur_codeobj->varnames.size() && "Varnames offset in bounds");
-                string varname = cur_codeobj->varnames[instr.arg];
-                BobObject* val = d->m_frame.env->lookup_var(varname);
-                if (!val)
-                    throw VMError(format_string("Unknown variable '%s' referenced", varname.c_str()));
-                d->m_valuestack.push_back(val);
-                break;
+                BobObject** cell = global_cell(d->m_global_env, instr->global);
+                if (!cell)
+                    throw VMError(format_string("Unknown variable '%s' referenced", instr->global->atom->name().c_str()));
+                d->m_valuestack.push_back(*cell);
+                VM_DISPATCH();
             }
-            case OP_STOREVAR:
+            VM_TARGET(OP_STOREVAR):
             {
-                assert(instr.arg < cur_codeobj->varnames.size() && "Varnames offset in bounds");
                 assert(!d->m_valuestack.empty() && "Pop value from non-empty valuestack");
                 BobObject* val = d->m_valuestack.back();
                 d->m_valuestack.pop_back();
-                string varname = cur_codeobj->varnames[instr.arg];
-                BobObject* retval = d->m_frame.env->set_var_value(varname, val);
-                if (!retval)
-                    throw VMError(format_string("Unknown variable '%s' referenced", varname.c_str()));
-                break;
+                BobObject** cell = global_cell(d->m_global_env, instr->global);
+                if (!cell)
+                    throw VMError(format_string("Unknown variable '%s' referenced", instr->global->atom->name().c_str()));
+                d->m_global_env->gc_write_barrier(val);
+                *cell = val;
+                VM_DISPATCH();
             }
-            case OP_DEFVAR:
+            VM_TARGET(OP_DEFVAR):
             {
-                assert(instr.arg < cur_codeobj->varnames.size() && "Varnames offset in bounds");
                 assert(!d->m_valuestack.empty() && "Pop value from non-empty valuestack");
                 BobObject* val = d->m_valuestack.back();
                 d->m_valuestack.pop_back();
-                d->m_frame.env->define_var(cur_codeobj->varnames[instr.arg], val);
-                break;
+                d->m_global_env->define_var(instr->atom, val);
+                VM_DISPATCH();
             }
-            case OP_POP:
+            VM_TARGET(OP_LOADLOCAL):
+            {
+                BobObject* val = d->m_frame.env->ancestor(instr->local.depth)->slot(instr->local.index);
+                if (!val)
+                    throw VMError("Unbound local variable referenced");
+                d->m_valuestack.push_back(val);
+                VM_DISPATCH();
+            }
+            VM_TARGET(OP_STORELOCAL):
+            {
+                assert(!d->m_valuestack.empty() && "Pop value from non-empty valuestack");
+                BobObject* val = d->m_valuestack.back();
+                d->m_valuestack.pop_back();
+                d->m_frame.env->ancestor(instr->local.depth)->set_slot(instr->local.index, val);
+                VM_DISPATCH();
+            }
+            VM_TARGET(OP_POP):
             {
                 // It's not a bug to generate instructions to pop the stack
                 // when there's nothing to pop.
                 //
                 if (!d->m_valuestack.empty())
                     d->m_valuestack.pop_back();
-                break;
+                VM_DISPATCH();
             }
-            case OP_JUMP:
+            VM_TARGET(OP_JUMP):
             {
-                d->m_frame.pc = instr.arg;
-                break;
+                if (instr->target <= instr)
+                    BobAllocator::get().safepoint();
+                ip = instr->target;
+                VM_DISPATCH();
             }
-            case OP_FJUMP:
+            VM_TARGET(OP_FJUMP):
             {
                 assert(!d->m_valuestack.empty() && "Pop value from non-empty valuestack");
-                BobBoolean* bool_predicate = dynamic_cast<BobBoolean*>(d->m_valuestack.back());
+                BobObject* predicate = d->m_valuestack.back();
                 d->m_valuestack.pop_back();
-                if (bool_predicate && !bool_predicate->value())
-                    d->m_frame.pc = instr.arg;
-                break;
+                if (predicate == BobBoolean::get(false))
+                    ip = instr->target;
+                VM_DISPATCH();
             }
-            case OP_FUNCTION:
+            VM_TARGET(OP_FUNCTION):
             {
-                assert(instr.arg < cur_codeobj->constants.size() && "Constants offset in bounds");
-                BobObject* val = cur_codeobj->constants[instr.arg];
-                BobCodeObject* func_codeobj = dynamic_cast<BobCodeObject*>(val);
-                assert(val && "Expected code object as the argument to OP_FUNCTION");
-                d->m_valuestack.push_back(new BobClosure(func_codeobj, d->m_frame.env));
-                break;
+                d->m_valuestack.push_back(new BobClosure(instr->codeobject, d->m_frame.env));
+                VM_DISPATCH();
             }
-            case OP_RETURN:
+            VM_TARGET(OP_RETURN):
             {
                 assert(!d->m_framestack.empty() && "OP_RETURN needs non-empty frame stack");
                 d->m_frame = d->m_framestack.back();
                 d->m_framestack.pop_back();
-                break;
+                ip = d->m_frame.pc;
+                VM_DISPATCH();
             }
-            case OP_CALL:
+            VM_TARGET(OP_CALL):
+            VM_TARGET(OP_TAILCALL):
             {
                 // For OP_CALL we have the function on top of the value stack,
                 // followed by its arguments (in reverse order). The amount of
                 // arguments is in the argument of the instruction.
                 // The function is either a builtin procedure or a closure.
+                // OP_TAILCALL is emitted for calls in tail position; it only
+                // differs from OP_CALL in not saving the current frame.
                 //
+                BobAllocator::get().safepoint();
+
                 assert(!d->m_valuestack.empty() && "Pop value from non-empty valuestack");
-                BobObject* func_val = d->m_valuestack.back();
+                call_func = d->m_valuestack.back();
                 d->m_valuestack.pop_back();
-                vector<BobObject*> argvalues;
+                call_argcount = instr->count;
+                call_tail = instr->opcode == OP_TAILCALL;
 
-                // Take the function's arguments from the stack. The last
-                // (right-most) argument is on top of the stack (first).
+            do_call:
+                // The arguments stay where they are on the stack until the
+                // call is set up, starting at args_base. The last
+                // (right-most) argument is on top of the stack.
                 //
-                for (unsigned i = 0; i < instr.arg; ++i) {
-                    assert(!d->m_valuestack.empty() && "Pop value from non-empty valuestack");
-                    argvalues.push_back(d->m_valuestack.back());
-                    d->m_valuestack.pop_back();
-                }
-                reverse(argvalues.begin(), argvalues.end());
+                assert(d->m_valuestack.size() >= call_argcount && "Call arguments on valuestack");
+                size_t args_base = d->m_valuestack.size() - call_argcount;
 
-                if (BobBuiltinProcedure* proc = dynamic_cast<BobBuiltinProcedure*>(func_val)) {
+                if (is<BobBuiltinProcedure>(call_func)) {
+                    BobBuiltinProcedure* proc = as<BobBuiltinProcedure>(call_func);
                     // Builtins wrap C++ procedures that should just be called
-                    // with the arguments.
+                    // with the arguments, which they see in place.
                     //
                     try {
-                        BobObject* retval = proc->exec(argvalues);
+                        BuiltinArgs args(d->m_valuestack.data() + args_base, call_argcount);
+                        BobObject* retval = proc->call(args);
+                        d->m_valuestack.resize(args_base);
                         d->m_valuestack.push_back(retval);
                     }
                     catch (const BuiltinError& err) {
                         throw VMError(err.what());
                     }
                 }
-                else if (BobClosure* closure = dynamic_cast<BobClosure*>(func_val)) {
-                    // Extend the closure's environment with one where its code
-                    // object's arguments are bound to the values passed to it
-                    // in the call.
+                else if (is<BobClosure>(call_func)) {
+                    BobClosure* closure = as<BobClosure>(call_func);
+                    // Extend the closure's environment with a new frame where
+                    // the slots of its code object's arguments hold the values
+                    // passed to it in the call.
                     //
-                    if (argvalues.size() != closure->codeobject->args.size())
+                    BobCodeObject* func_codeobj = closure->codeobject;
+                    if (!func_codeobj->is_materialized())
+                        func_codeobj->materialize();
+                    if (call_argcount != func_codeobj->args.size())
                         throw VMError(format_string("Calling procedure %s with %d args, expected %d",
-                                        closure->codeobject->name.c_str(),
-                                        argvalues.size(),
-                                        closure->codeobject->args.size()));
-
-                    BobEnvironment* call_env = new BobEnvironment(closure->env);
-                    for (size_t i = 0; i < argvalues.size(); ++i) {
-                        string argname = closure->codeobject->args[i];
-                        BobObject* argvalue = argvalues[i];
-                        call_env->define_var(argname, argvalue);
-                    }
+                                        func_codeobj->name.str().c_str(),
+                                        call_argcount,
+                                        func_codeobj->args.size()));
+
+                    BobFrame* call_env = BobFrame::create(closure->env, func_codeobj->frame_size);
+                    for (unsigned i = 0; i < call_argcount; ++i)
+                        call_env->set_slot(i, d->m_valuestack[args_base + i]);
+                    d->m_valuestack.resize(args_base);
 
                     // To execute the procedure:
-                    // 1. Save the current execution frame on the frame stack
+                    // 1. Save the current execution frame on the frame stack,
+                    //    with the pc pointing past this instruction. A tail
+                    //    call skips this step: the current frame has nothing
+                    //    left to do, so the callee returns directly to its
+                    //    caller and the frame stack doesn't grow.
                     // 2. Create a new frame from the closure's code object
                     //    and the extendend environment.
                     // 3. Start executing the frame by making it the current
-                    //    frame with pc=0. The procedure's first instruction
-                    //    will then execute in the next iteration of this
-                    //    loop.
+                    //    frame with pc at its first instruction, which will
+                    //    then be dispatched next.
                     //
-                    d->m_framestack.push_back(d->m_frame);
+                    if (!call_tail) {
+                        d->m_frame.pc = ip;
+                        d->m_framestack.push_back(d->m_frame);
+                    }
                     ExecutionFrame new_frame;
-                    new_frame.codeobject = closure->codeobject;
-                    new_frame.pc = 0;
+                    new_frame.codeobject = func_codeobj;
+                    new_frame.pc = func_codeobj->exec_code.data();
                     new_frame.env = call_env;
                     d->m_frame = new_frame;
+                    ip = d->m_frame.pc;
                 }
                 else
-                    assert(0 && "Expected callable object on TOS for OP_CALL");
+                    assert(0 && "Expected callable object on TOS for OP_CALL/OP_TAILCALL");
 
-                break;
+                VM_DISPATCH();
+            }
+            VM_BINARY_OP(OP_ADD, make_number(add_numbers(a, b)))
+            VM_BINARY_OP(OP_SUB, make_number(sub_numbers(a, b)))
+            VM_BINARY_OP(OP_MUL, make_number(mul_numbers(a, b)))
+            VM_BINARY_OP(OP_NUMEQ, BobBoolean::get(a == b))
+            VM_BINARY_OP(OP_LT, BobBoolean::get(a < b))
+            VM_BINARY_OP(OP_GT, BobBoolean::get(a > b))
+            VM_BINARY_OP(OP_LE, BobBoolean::get(a <= b))
+            VM_BINARY_OP(OP_GE, BobBoolean::get(a >= b))
+            VM_TARGET(OP_END):
+            {
+                // Running past the last instruction is how the top-level code
+                // object finishes. Procedures must end with OP_RETURN.
+                //
+                if (d->m_framestack.empty())
+                    return;
+                else
+                    throw VMError("Code object ended prematurely");
             }
             default:
-                throw VMError(format_string("Invalid instruction opcode 0x%02X", instr.opcode));
+#if BOB_USE_COMPUTED_GOTO
+            target_invalid:
+#endif
+                throw VMError(format_string("Invalid instruction opcode 0x%02X", instr->opcode));
         }
     }
+
+#undef VM_FETCH
+#undef VM_TARGET
+#undef VM_DISPATCH
+#undef VM_BINARY_OP
 }
 
 
-void BobVM::gc_mark_roots()
+void BobVM::gc_visit_roots(BobObjectVisitor& visitor)
 {
-    // current frame
-    d->m_frame.codeobject->gc_mark();
-    d->m_frame.env->gc_mark();
+    // the global environment
+    visitor.visit(d->m_global_env);
+
+    // the builtins of the binary operation instructions, which must keep
+    // their identity even if their names were rebound
+    for (unsigned i = 0; i <= OP_GE - OP_ADD; ++i)
+        visitor.visit(d->m_binary_op_builtins[i]);
+
+    // current frame, once the VM runs
+    if (d->m_frame.codeobject)
+        visitor.visit(d->m_frame.codeobject);
+    if (d->m_frame.env)
+        visitor.visit(d->m_frame.env);
 
     // all objects in the value stack
-    for (deque<BobObject*>::iterator it = d->m_valuestack.begin();
+    for (vector<BobObject*>::iterator it = d->m_valuestack.begin();
             it != d->m_valuestack.end(); ++it) {
-        (*it)->gc_mark();
+        visitor.visit(*it);
     }
 
     // all frames in the frame stack
     for (deque<ExecutionFrame>::iterator it = d->m_framestack.begin();
             it != d->m_framestack.end(); ++it) {
-        it->codeobject->gc_mark();
-        it->env->gc_mark();
+        visitor.visit(it->codeobject);
+        if (it->env)
+            visitor.visit(it->env);
     }
 }
 
@@ -381,19 +591,19 @@ void BobVM::gc_mark_roots()
 // and member function pointer to call a builtin function that's actually
 // defined inside BobVM and thus has access to its state.
 //
-typedef BobObject* (VMImpl::*VMBuiltinProc)(BuiltinArgs& args);
+typedef BobObject* (VMImpl::*VMBuiltinProc)(const BuiltinArgs& args);
 
 class BobVMBuiltinProcedure : public BobBuiltinProcedure
 {
 public:
-    BobVMBuiltinProcedure(const string& name, VMImpl& vmobj, VMBuiltinProc builtin)
-        : BobBuiltinProcedure(name, 0), m_vmobj(vmobj), m_builtin(builtin)
+    BobVMBuiltinProcedure(const string& name, VMImpl& vmobj, VMBuiltinProc builtin, int arity)
+        : BobBuiltinProcedure(name, 0, arity), m_vmobj(vmobj), m_builtin(builtin)
     {}
 
     virtual ~BobVMBuiltinProcedure()
     {}
 
-    virtual BobObject* exec(BuiltinArgs& args) const
+    virtual BobObject* exec(const BuiltinArgs& args) const
     {
         // Invoke the member function via a pointer on the object
         //
@@ -411,36 +621,47 @@ BobEnvironment* VMImpl::create_global_env()
     BuiltinsMap builtins_map = make_builtins_map();
     BobEnvironment* env = new BobEnvironment;
 
+    // The builtins are never collected, unlike the environment, which
+    // changes with the program's definitions
+    //
+    BobPermanentScope permanent;
+
     // Add all the standard builtin procedures from the builtins module to the
     // environment
     //
     for (BuiltinsMap::const_iterator i = builtins_map.begin(); i != builtins_map.end(); ++i) {
-        BobObject* proc = new BobBuiltinProcedure(i->first, i->second);
-        env->define_var(i->first, proc);
+        BobObject* proc = new BobBuiltinProcedure(i->first, i->second.proc, i->second.arity);
+        env->define_var(BobAtom::intern(i->first), proc);
     }
 
     // Now add the builtins defined as member functions of BobVM and have
     // access to its state.
     //
-    env->define_var("write",
-            new BobVMBuiltinProcedure("write", *this, &VMImpl::builtin_write));
-    env->define_var("__debug-vm",
-            new BobVMBuiltinProcedure("__debug-vm", *this, &VMImpl::builtin_debug_vm));
-    env->define_var("__run-gc",
-            new BobVMBuiltinProcedure("__run-gc", *this, &VMImpl::builtin_run_gc));
-    env->define_var("__debug-gc",
-            new BobVMBuiltinProcedure("__debug-gc", *this, &VMImpl::builtin_debug_gc));
+    env->define_var(BobAtom::intern("write"),
+            new BobVMBuiltinProcedure("write", *this, &VMImpl::builtin_write, BUILTIN_VARIADIC));
+    env->define_var(BobAtom::intern("__debug-vm"),
+            new BobVMBuiltinProcedure("__debug-vm", *this, &VMImpl::builtin_debug_vm, 0));
+    env->define_var(BobAtom::intern("__run-gc"),
+            new BobVMBuiltinProcedure("__run-gc", *this, &VMImpl::builtin_run_gc, 0));
+    env->define_var(BobAtom::intern("__debug-gc"),
+            new BobVMBuiltinProcedure("__debug-gc", *this, &VMImpl::builtin_debug_gc, BUILTIN_VARIADIC));
+
+    static const char* binary_op_names[OP_GE - OP_ADD + 1] = {"+", "-", "*", "=", "<", ">", "<=", ">="};
+    for (unsigned i = 0; i <= OP_GE - OP_ADD; ++i) {
+        m_binary_op_builtins[i] = env->lookup_var(BobAtom::intern(binary_op_names[i]));
+        assert(m_binary_op_builtins[i] && "Binary operation builtin missing");
+    }
 
     return env;
 }
 
 
-BobObject* VMImpl::builtin_write(BuiltinArgs& args)
+BobObject* VMImpl::builtin_write(const BuiltinArgs& args)
 {
     string output_str;
 
     for (BuiltinArgsIteratorConst i = args.begin(); i != args.end(); ++i) {
-        output_str += (*i)->repr();
+        output_str += object_repr(*i);
 
         if (i != args.end() - 1)
             output_str += " ";
@@ -448,15 +669,15 @@ BobObject* VMImpl::builtin_write(BuiltinArgs& args)
     output_str += "\n";
     fputs(output_str.c_str(), m_output_stream);
 
-    return new BobNull;
+    return BobNull::get();
 }
 
 
-BobObject* VMImpl::builtin_debug_vm(BuiltinArgs&)
+BobObject* VMImpl::builtin_debug_vm(const BuiltinArgs&)
 {
     string str = repr_vm_state();
     fputs(str.c_str(), m_output_stream);
-    return new BobNull;
+    return BobNull::get();
 }
 
 
@@ -468,19 +689,19 @@ static string frame_printer(ExecutionFrame frame)
 
 static string value_printer(BobObject* value)
 {
-    return "| " + value->repr();
+    return "| " + object_repr(value);
 }
 
 
-template <class T>
-static string repr_stack(deque<T>& thestack, string name, string (*printer)(T))
+template <class Stack, class T>
+static string repr_stack(Stack& thestack, string name, string (*printer)(T))
 {
     string head = string(8 + name.size(), '-');
     string str = format_string("+%s+\n| %s stack |\n+%s+\n\n",
                     head.c_str(), name.c_str(), head.c_str());
 
     bool tos = true;
-    for (typename deque<T>::reverse_iterator rit = thestack.rbegin();
+    for (typename Stack::reverse_iterator rit = thestack.rbegin();
             rit != thestack.rend(); ++rit) {
         str += "     |--------\n";
         str += tos ? "TOS: " : "     ";
@@ -502,30 +723,29 @@ string VMImpl::repr_vm_state()
 }
 
 
-BobObject* VMImpl::builtin_run_gc(BuiltinArgs&)
+BobObject* VMImpl::builtin_run_gc(const BuiltinArgs&)
 {
-    // Force a GC run by setting threshold to 0
-    BobAllocator::get().run_gc(0);
-    return new BobNull;
+    BobAllocator::get().run_full_gc();
+    return BobNull::get();
 }
 
 
 // Print debugging information about the allocator/garbage collector.
 // If an argument is given and it's #t, print all live objects.
 //
-BobObject* VMImpl::builtin_debug_gc(BuiltinArgs& args)
+BobObject* VMImpl::builtin_debug_gc(const BuiltinArgs& args)
 {
     string str = BobAllocator::get().stats_general();
     fputs(str.c_str(), m_output_stream);
 
     if (args.size() > 0) {
-        if (BobBoolean* boolean = dynamic_cast<BobBoolean*>(args[0])) {
+        if (BobBoolean* boolean = object_cast<BobBoolean>(args[0])) {
             if (boolean->value() == true) {
                 str = BobAllocator::get().stats_all_live();
                 fputs(str.c_str(), m_output_stream);
             }
         }
     }
-    return new BobNull;
+    return BobNull::get();
 }
 
@@ -36,16 +36,56 @@ public:
     virtual ~BobVM();
 
     void run(BobCodeObject* codeobj);
-    void set_gc_size_threshold(std::size_t threshold);
+
+    // Save the definitions made in the global environment, and all the
+    // objects they refer to, into a heap image file, or add those of an
+    // image saved before to the global environment. Loading an image
+    // before running code that uses its definitions spares running the
+    // code that made them again. An image must be loaded before the code
+    // redefines any builtin.
+    //
+    void save_snapshot(const std::string& filename);
+    void load_snapshot(const std::string& filename);
+
+    // The heap growth policy of the GC (see
+    // BobAllocator::set_size_threshold): collect once the heap has grown to
+    // heap_growth times the data that survived the previous collection,
+    // but after allocating no less than min_threshold bytes and no more
+    // than max_threshold (0 for no limit). With a non-zero time ratio, the
+    // heap grows faster while collecting takes more than that fraction of
+    // the time.
+    //
+    void set_gc_size_threshold(std::size_t min_threshold, std::size_t max_threshold = 0);
+    void set_gc_heap_growth(double heap_growth);
+    void set_gc_time_ratio(double ratio);
+
+    // Bound the pauses of major collections to about budget_us
+    // microseconds per step, by marking incrementally. 0 (the default)
+    // runs them to completion in one pause.
+    //
+    void set_gc_pause_budget(unsigned budget_us);
+
+    // Mark the heap with num_threads threads in stop-the-world
+    // collections. The default is taken from the BOB_GC_THREADS
+    // environment variable, or 1 if it isn't set.
+    //
+    void set_gc_threads(unsigned num_threads);
+
+    // Compact the heap in major collections, moving the live pairs,
+    // closures and frames next to the objects pointing to them. The
+    // default is taken from the BOB_GC_COMPACT environment variable (on if
+    // it's set to a non-zero number), or off if it isn't set.
+    //
+    void set_gc_compacting(bool compacting);
 private:
     friend class BobAllocator;
     BobVM(const BobVM&);
     BobVM& operator=(const BobVM&);
 
-    // Run gc_mark on all root objects the VM holds. This method
-    // is called by the garbage collector.
+    // Pass all root pointers the VM holds to the visitor, which may update
+    // them. This method is called by the garbage collector.
     //
-    void gc_mark_roots();
+    void gc_visit_roots(BobObjectVisitor& visitor);
 
     VMImpl* d;
 };
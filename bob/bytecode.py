@@ -7,7 +7,18 @@
 # This code is in the public domain
 # -------------------------------------------------------------------------------
 from __future__ import print_function
-from .utils import pack_word, unpack_word, get_bytes_from_iterator
+import struct
+from .utils import (
+    pack_word,
+    unpack_word,
+    pack_words,
+    unpack_words,
+    pack_varint,
+    unpack_varint,
+    zigzag,
+    unzigzag,
+    get_bytes_from_iterator,
+)
 from .expr import Pair, Boolean, Symbol, Number, expr_repr
 
 
@@ -15,12 +26,23 @@ OP_CONST = 0x00
 OP_LOADVAR = 0x10
 OP_STOREVAR = 0x11
 OP_DEFVAR = 0x12
+OP_LOADLOCAL = 0x13
+OP_STORELOCAL = 0x14
 OP_FUNCTION = 0x20
 OP_POP = 0x30
 OP_JUMP = 0x40
 OP_FJUMP = 0x41
 OP_RETURN = 0x50
 OP_CALL = 0x51
+OP_TAILCALL = 0x52
+OP_ADD = 0x60
+OP_SUB = 0x61
+OP_MUL = 0x62
+OP_NUMEQ = 0x63
+OP_LT = 0x64
+OP_GT = 0x65
+OP_LE = 0x66
+OP_GE = 0x67
 
 
 _opcode2str_map = {
@@ -28,12 +50,23 @@ _opcode2str_map = {
     OP_LOADVAR: "LOADVAR",
     OP_STOREVAR: "STOREVAR",
     OP_DEFVAR: "DEFVAR",
+    OP_LOADLOCAL: "LOADLOCAL",
+    OP_STORELOCAL: "STORELOCAL",
     OP_FUNCTION: "FUNCTION",
     OP_POP: "POP",
     OP_JUMP: "JUMP",
     OP_FJUMP: "FJUMP",
     OP_RETURN: "RETURN",
     OP_CALL: "CALL",
+    OP_TAILCALL: "TAILCALL",
+    OP_ADD: "ADD",
+    OP_SUB: "SUB",
+    OP_MUL: "MUL",
+    OP_NUMEQ: "NUMEQ",
+    OP_LT: "LT",
+    OP_GT: "GT",
+    OP_LE: "LE",
+    OP_GE: "GE",
 }
 
 
@@ -41,6 +74,49 @@ def opcode2str(opcode):
     return _opcode2str_map[opcode]
 
 
+# Binary arithmetic and comparison instructions, mapped from the name of the
+# global builtin they stand for. The compiler emits them for applications of
+# these builtins to two operands. Their argument is the varname of the
+# builtin, so that the VM can fall back to calling whatever is bound to it if
+# the program redefined it.
+#
+binary_op_builtins = {
+    '+': OP_ADD,
+    '-': OP_SUB,
+    '*': OP_MUL,
+    '=': OP_NUMEQ,
+    '<': OP_LT,
+    '>': OP_GT,
+    '<=': OP_LE,
+    '>=': OP_GE,
+}
+
+
+# LOADLOCAL and STORELOCAL refer to a slot in a procedure frame. The compiler
+# resolves the variable into a (depth, index) pair: the number of frames to
+# climb from the current one, and the slot index in that frame. Both are
+# packed into the 24-bit instruction argument - depth in bits 16..23 and index
+# in bits 0..15.
+#
+LOCAL_DEPTH_SHIFT = 16
+LOCAL_INDEX_MASK = 0xFFFF
+MAX_LOCAL_DEPTH = 0xFF
+
+
+def make_local_arg(depth, index):
+    assert depth <= MAX_LOCAL_DEPTH and index <= LOCAL_INDEX_MASK
+    return (depth << LOCAL_DEPTH_SHIFT) | index
+
+
+def split_local_arg(arg):
+    """Split the argument of LOADLOCAL/STORELOCAL into (depth, index)."""
+    return arg >> LOCAL_DEPTH_SHIFT, arg & LOCAL_INDEX_MASK
+
+
+def is_binary_op(opcode):
+    return OP_ADD <= opcode <= OP_GE
+
+
 class Instruction(object):
     """A bytecode instruction. The opcode is one of the OP_... constants
     defined above.
@@ -77,8 +153,10 @@ class CodeObject(object):
         constants by their index in this list.
 
     varnames:
-        A list of strings specifying variable names referenced in the code.
-        The variables are referenced by their index in this list.
+        A list of strings specifying names of global variables referenced in
+        the code. The variables are referenced by their index in this list.
+        Local variables of procedures are referenced by their frame slot and
+        have no names in the code object.
     """
 
     def __init__(self):
@@ -87,6 +165,23 @@ class CodeObject(object):
         self.code = []
         self.constants = []
         self.varnames = []
+        self._frame_size = None
+
+    def frame_size(self):
+        """The number of slots in the frame of a call to this procedure: its
+        arguments, followed by its internal definitions. Every slot beyond the
+        arguments is assigned by a STORELOCAL at depth 0 in this code object,
+        so the size can be derived from the code.
+        """
+        if self._frame_size is None:
+            size = len(self.args)
+            for instr in self.code:
+                if instr.opcode in (OP_LOADLOCAL, OP_STORELOCAL):
+                    depth, index = split_local_arg(instr.arg)
+                    if depth == 0:
+                        size = max(size, index + 1)
+            self._frame_size = size
+        return self._frame_size
 
     def __repr__(self, nesting=0):
         repr = ""
@@ -106,11 +201,14 @@ class CodeObject(object):
                     instr.arg,
                     expr_repr(self.constants[instr.arg]),
                 )
-            elif instr.opcode in (OP_LOADVAR, OP_STOREVAR, OP_DEFVAR):
+            elif instr.opcode in (OP_LOADVAR, OP_STOREVAR, OP_DEFVAR) or is_binary_op(instr.opcode):
                 repr += "%4s {= %s}\n" % (instr.arg, self.varnames[instr.arg])
+            elif instr.opcode in (OP_LOADLOCAL, OP_STORELOCAL):
+                depth, index = split_local_arg(instr.arg)
+                repr += "%4s {= %s,%s}\n" % (instr.arg, depth, index)
             elif instr.opcode in (OP_FJUMP, OP_JUMP):
                 repr += "%4s\n" % instr.arg
-            elif instr.opcode == OP_CALL:
+            elif instr.opcode in (OP_CALL, OP_TAILCALL):
                 repr += "%4s\n" % instr.arg
             elif instr.opcode in (OP_POP, OP_RETURN):
                 repr += "\n"
@@ -141,6 +239,46 @@ class CodeObject(object):
 # version in the high two bytes and 0B0B in the low two bytes.
 MAGIC_CONST = 0x00010B0B
 
+# Version 2 of the format is sectioned, and shares names and constants
+# between all the code objects of a bytecode. The magic constant is followed
+# by the number of sections and a directory with an (id, offset, size) triple
+# of words per section. Offsets are from the start of the bytecode and
+# word-aligned. All words are little-endian. Inside sections, integers other
+# than instructions are varints (see utils.pack_varint). The sections are:
+#
+# STRINGS: the number of distinct strings, and the length and characters of
+#   each. Names and symbols refer to strings by index.
+#
+# CONSTANTS: the number of constants, and a TYPE_ byte for each, followed by
+#   its value. Numbers keep their zigzag-encoded value (see utils.zigzag),
+#   booleans a 0 or 1 byte and symbols the index of their string. A pair
+#   keeps the distances back from it to the constants of its first and
+#   second elements, which come before it. A code object constant keeps the
+#   index of the code object. Equal numbers, booleans, nulls and symbols
+#   are stored once for all the code objects; pairs never are, since every
+#   quoted list in the program is a distinct object.
+#
+# CODEOBJECTS: the number of code objects, the index of the top-level one,
+#   and for each code object the string index of its name and the numbers
+#   of its args, constants, varnames and instructions.
+#
+# REFS: for each code object in turn, the string indices of its args, the
+#   constant indices of its constants and the string indices of its
+#   varnames.
+#
+# CODE: the instructions of each code object in turn, one word each in the
+#   same encoding as version 1.
+#
+# Unknown sections are ignored.
+#
+MAGIC_CONST_V2 = 0x00020B0B
+
+SECTION_STRINGS = 1
+SECTION_CONSTANTS = 2
+SECTION_CODEOBJECTS = 3
+SECTION_REFS = 4
+SECTION_CODE = 5
+
 TYPE_NULL = b"0"
 TYPE_BOOLEAN = b"b"
 TYPE_STRING = b"s"
@@ -153,12 +291,18 @@ TYPE_CODEOBJECT = b"c"
 
 
 class Serializer(object):
-    """Serializes a CodeObject to a string."""
+    """Serializes a CodeObject to a string. version selects the format: 2 by
+    default, or 1 for VMs that don't support version 2.
+    """
 
     # Each function beginning with _s serializes some type and returns
     # a string representing the serialized object.
     #
-    def __init__(self):
+    def __init__(self, version=2):
+        if version not in (1, 2):
+            raise ValueError("Unknown bytecode version %s" % version)
+        self.version = version
+
         # Allows dispatching serialization of Bob objects according to their
         # types
         #
@@ -178,6 +322,9 @@ class Serializer(object):
         """Serialize a top-level CodeObject into a string that can be written
         into a file.
         """
+        if self.version == 2:
+            return _SectionedSerializer().serialize_bytecode(codeobject)
+
         s = self._s_word(MAGIC_CONST)
         s += self._s_codeobject(codeobject)
         return s
@@ -238,6 +385,132 @@ class Serializer(object):
         return s
 
 
+class _SectionedSerializer(object):
+    """Serializes a CodeObject in version 2 of the format. It interns the
+    strings and constants of all the code objects as it goes, so a new one
+    is needed for every bytecode.
+    """
+
+    def __init__(self):
+        self.strings = []
+        self.string_indices = {}
+        self.constants = []
+        self.constant_indices = {}
+        self.codeobjects = []
+        self.refs = []
+        self.code = []
+
+    def serialize_bytecode(self, codeobject):
+        root = self._codeobject(codeobject)
+
+        strings = [pack_varint(len(self.strings))]
+        for string in self.strings:
+            strings.append(pack_varint(len(string)) + string)
+
+        constants = [pack_varint(len(self.constants))]
+        for index, (type, value) in enumerate(self.constants):
+            if type == TYPE_BOOLEAN:
+                constants.append(type + bytes([value]))
+            elif type == TYPE_PAIR:
+                constants.append(
+                    type + pack_varint(index - value[0]) + pack_varint(index - value[1])
+                )
+            elif type == TYPE_NULL:
+                constants.append(type)
+            elif type == TYPE_NUMBER:
+                constants.append(type + pack_varint(zigzag(value)))
+            else:
+                constants.append(type + pack_varint(value))
+
+        codeobjects = [pack_varint(len(self.codeobjects)), pack_varint(root)]
+        codeobjects.extend(pack_varint(n) for entry in self.codeobjects for n in entry)
+
+        sections = [
+            (SECTION_STRINGS, b"".join(strings)),
+            (SECTION_CONSTANTS, b"".join(constants)),
+            (SECTION_CODEOBJECTS, b"".join(codeobjects)),
+            (SECTION_REFS, b"".join(pack_varint(r) for r in self.refs)),
+            (SECTION_CODE, pack_words(self.code)),
+        ]
+
+        s = pack_words([MAGIC_CONST_V2, len(sections)])
+        offset = len(s) + 12 * len(sections)
+        data = []
+        for id, section in sections:
+            s += pack_words([id, offset, len(section)])
+            padding = b"\0" * (-len(section) % 4)
+            data.append(section + padding)
+            offset += len(section) + len(padding)
+        return s + b"".join(data)
+
+    def _string(self, string):
+        index = self.string_indices.get(string)
+        if index is None:
+            index = len(self.strings)
+            self.strings.append(string.encode("ascii"))
+            self.string_indices[string] = index
+        return index
+
+    def _add_constant(self, type, value):
+        self.constants.append((type, value))
+        return len(self.constants) - 1
+
+    def _intern_constant(self, type, value):
+        index = self.constant_indices.get((type, value))
+        if index is None:
+            index = self._add_constant(type, value)
+            self.constant_indices[(type, value)] = index
+        return index
+
+    def _constant(self, obj):
+        if obj is None:
+            return self._intern_constant(TYPE_NULL, None)
+        elif isinstance(obj, Boolean):
+            return self._intern_constant(TYPE_BOOLEAN, int(obj.value))
+        elif isinstance(obj, Number):
+            return self._intern_constant(TYPE_NUMBER, obj.value)
+        elif isinstance(obj, Symbol):
+            return self._intern_constant(TYPE_SYMBOL, self._string(obj.value))
+        elif isinstance(obj, Pair):
+            # Walk down the list iteratively, so that long quoted lists don't
+            # exhaust the recursion limit. Its tail has to be added first.
+            spine = []
+            while isinstance(obj, Pair):
+                spine.append(obj)
+                obj = obj.second
+            index = self._constant(obj)
+            for pair in reversed(spine):
+                index = self._add_constant(TYPE_PAIR, (self._constant(pair.first), index))
+            return index
+        elif isinstance(obj, CodeObject):
+            return self._add_constant(TYPE_CODEOBJECT, self._codeobject(obj))
+        else:
+            raise ValueError("Unexpected constant %s" % obj)
+
+    def _codeobject(self, codeobject):
+        # Nested code objects are added first, the top-level one last.
+        constants = [self._constant(c) for c in codeobject.constants]
+
+        self.refs.extend(self._string(a) for a in codeobject.args)
+        self.refs.extend(constants)
+        self.refs.extend(self._string(v) for v in codeobject.varnames)
+
+        for instr in codeobject.code:
+            arg = instr.arg or 0
+            self.code.append((instr.opcode << 24) | (arg & 0xFFFFFF))
+
+        self.codeobjects.append(
+            (
+                self._string(codeobject.name),
+                len(codeobject.args),
+                len(constants),
+                len(codeobject.varnames),
+                len(codeobject.code),
+            )
+        )
+        return len(self.codeobjects) - 1
+
+
 class Deserializer(object):
     """Deserializes a CodeObjct from a string"""
 
@@ -268,6 +541,9 @@ class Deserializer(object):
         """Given a string with a serialized code object, converts it onto
         a CodeObject.
         """
+        if str[:4] == pack_word(MAGIC_CONST_V2):
+            return self._deserialize_sectioned(str)
+
         try:
             stream = iter(str)
             magic = self._d_word(stream)
@@ -336,3 +612,108 @@ class Deserializer(object):
         co.args, co.constants, co.varnames, co.code = seqs
 
         return co
+
+    def _deserialize_sectioned(self, str):
+        """Deserializes version 2 of the format."""
+        try:
+            (nsections,) = unpack_words(str, 4, 1)
+            sections = {}
+            for i in range(nsections):
+                id, offset, size = unpack_words(str, 8 + 12 * i, 3)
+                if offset + size > len(str):
+                    raise self.DeserializationError("Section %s out of range" % id)
+                sections[id] = str[offset : offset + size]
+
+            for id in (
+                SECTION_STRINGS,
+                SECTION_CONSTANTS,
+                SECTION_CODEOBJECTS,
+                SECTION_REFS,
+                SECTION_CODE,
+            ):
+                if id not in sections:
+                    raise self.DeserializationError("Section %s missing" % id)
+
+            data = sections[SECTION_STRINGS]
+            count, offset = unpack_varint(data, 0)
+            strings = []
+            for i in range(count):
+                length, offset = unpack_varint(data, offset)
+                if offset + length > len(data):
+                    raise self.DeserializationError("String out of range")
+                strings.append(data[offset : offset + length].decode("ascii"))
+                offset += length
+
+            data = sections[SECTION_CODEOBJECTS]
+            count, offset = unpack_varint(data, 0)
+            root, offset = unpack_varint(data, offset)
+            entries = []
+            for i in range(5 * count):
+                n, offset = unpack_varint(data, offset)
+                entries.append(n)
+            codeobjects = [CodeObject() for i in range(count)]
+
+            data = sections[SECTION_CONSTANTS]
+            count, offset = unpack_varint(data, 0)
+            constants = []
+            for i in range(count):
+                constant, offset = self._d_constant(data, offset, strings, constants, codeobjects)
+                constants.append(constant)
+
+            data = sections[SECTION_REFS]
+            offset = 0
+            code = sections[SECTION_CODE]
+            code_offset = 0
+            for i, co in enumerate(codeobjects):
+                name, nargs, nconstants, nvarnames, ncode = entries[5 * i : 5 * i + 5]
+                co.name = strings[name]
+                co.args, offset = self._d_refs(data, offset, strings, nargs)
+                co.constants, offset = self._d_refs(data, offset, constants, nconstants)
+                co.varnames, offset = self._d_refs(data, offset, strings, nvarnames)
+                co.code = [
+                    Instruction(w >> 24, w & 0xFFFFFF)
+                    for w in unpack_words(code, code_offset, ncode)
+                ]
+                code_offset += 4 * ncode
+
+            return codeobjects[root]
+        except (struct.error, IndexError) as e:
+            raise self.DeserializationError("Invalid bytecode: %s" % e)
+
+    def _d_refs(self, data, offset, table, count):
+        """Deserializes count indices into table, starting at offset. Returns
+        the list of referenced elements and the offset following it.
+        """
+        seq = []
+        for i in range(count):
+            index, offset = unpack_varint(data, offset)
+            seq.append(table[index])
+        return seq, offset
+
+    def _d_constant(self, data, offset, strings, constants, codeobjects):
+        """Deserializes the constant at offset. Returns the constant and the
+        offset following it.
+        """
+        type = data[offset : offset + 1]
+        offset += 1
+        if type == TYPE_NULL:
+            return None, offset
+        elif type == TYPE_BOOLEAN:
+            return Boolean(data[offset] == 1), offset + 1
+        elif type == TYPE_PAIR:
+            first, offset = unpack_varint(data, offset)
+            second, offset = unpack_varint(data, offset)
+            index = len(constants)
+            if not 0 < first <= index or not 0 < second <= index:
+                raise self.DeserializationError("Pair refers to a later constant")
+            return Pair(constants[index - first], constants[index - second]), offset
+
+        value, offset = unpack_varint(data, offset)
+        if type == TYPE_NUMBER:
+            return Number(unzigzag(value)), offset
+        elif type == TYPE_SYMBOL:
+            return Symbol(strings[value]), offset
+        elif type == TYPE_CODEOBJECT:
+            return codeobjects[value], offset
+        else:
+            raise self.DeserializationError("Unexpected constant type %s" % type)
@@ -19,9 +19,11 @@ from bob.interpreter import (expr_repr, interpret_code, BobInterpreter,
 from bob.vm import BobVM
 
 
-def compile_file(filename=None, out_filename=None, disassemble=False):
+def compile_file(filename=None, out_filename=None, disassemble=False,
+                 version=2):
     """ Given the name of a .scm file, compile it with the Bob compiler
-        to produce a corresponding .bobc file.
+        to produce a corresponding .bobc file, in the given version of the
+        bytecode format.
     """
     if not filename:
         filename = sys.argv[1]
@@ -31,7 +33,7 @@ def compile_file(filename=None, out_filename=None, disassemble=False):
         print(codeobject)
         return
 
-    serialized = Serializer().serialize_bytecode(codeobject)
+    serialized = Serializer(version).serialize_bytecode(codeobject)
 
     # Create the output file
     if not out_filename:
@@ -104,6 +106,9 @@ def main():
         help="Disassemble a bytecode file", action='store_true')
     parser.add_argument('-o', '--output',
         help="Output filename for compilation", type=str)
+    parser.add_argument('--bytecode-version',
+        help="Bytecode format version for compilation (default 2)",
+        type=int, choices=(1, 2), default=2)
     parser.add_argument('filename', nargs="?",
         help='filename to compile (-c) or run')
 
@@ -120,7 +125,8 @@ def main():
         if args.compile:  # and possibly args.disassemble
             if not is_scm:
                 parser.error("can only compile .scm files")
-            compile_file(args.filename, args.output, args.disassemble)
+            compile_file(args.filename, args.output, args.disassemble,
+                         args.bytecode_version)
         elif args.disassemble:
             if is_scm:
                 parser.error("can only disassemble bytecode files")
@@ -24,6 +24,20 @@ class CompiledLabel(object):
         return str(self.name)
 
 
+class LocalVariable(object):
+    """ A variable bound in a procedure frame, resolved at compile time into
+        the number of frames to climb from the current one (depth) and its
+        slot in that frame (index).
+    """
+    def __init__(self, name, depth, index):
+        self.name = name
+        self.depth = depth
+        self.index = index
+
+    def __repr__(self):
+        return '%s [%s,%s]' % (self.name, self.depth, self.index)
+
+
 class CompiledProcedure(object):
     """ Represents a compiled procedure.
 
@@ -79,6 +93,13 @@ class BobCompiler(object):
     def __init__(self):
         self.labelstate = 0
 
+        # The frames of the procedures enclosing the code being compiled,
+        # innermost last. Each frame is a list of the names bound in it: the
+        # procedure's arguments followed by its internal definitions. Names
+        # not found in any of the frames are global.
+        #
+        self.frames = []
+
     def compile(self, exprlist):
         """ Compile a list of parsed expressions (what's returned by
             BobParser.parse) into a single argument-less CompiledProcedure
@@ -103,8 +124,10 @@ class BobCompiler(object):
         """
         return list(flatten(args))
 
-    def _comp(self, expr):
-        """ Compile an expression.
+    def _comp(self, expr, tail=False):
+        """ Compile an expression. tail is True when the expression is in
+            tail position in a procedure: its value is the procedure's return
+            value.
 
             Always returns a (Python) list of instructions.
         """
@@ -113,30 +136,90 @@ class BobCompiler(object):
         if is_self_evaluating(expr):
             return self._instr(OP_CONST, expr)
         elif is_variable(expr):
-            return self._instr(OP_LOADVAR, expr)
+            local = self._find_local(expr)
+            if local is None:
+                return self._instr(OP_LOADVAR, expr)
+            else:
+                return self._instr(OP_LOADLOCAL, local)
         elif is_quoted(expr):
             return self._instr(OP_CONST, text_of_quotation(expr))
         elif is_assignment(expr):
             return self._instr_seq(
                             self._comp(assignment_value(expr)),
-                            self._instr(OP_STOREVAR, assignment_variable(expr)))
+                            self._comp_store(assignment_variable(expr)),
+                            self._instr(OP_CONST, None))
         elif is_definition(expr):
             return self._comp_definition(expr)
         elif is_if(expr):
-            return self._comp_if(expr)
+            return self._comp_if(expr, tail)
         elif is_cond(expr):
-            return self._comp(convert_cond_to_ifs(expr))
+            return self._comp(convert_cond_to_ifs(expr), tail)
         elif is_let(expr):
-            return self._comp(convert_let_to_application(expr))
+            return self._comp(convert_let_to_application(expr), tail)
         elif is_lambda(expr):
             return self._comp_lambda(expr)
         elif is_begin(expr):
-            return self._comp_begin(begin_actions(expr))
+            return self._comp_begin(begin_actions(expr), tail)
         elif is_application(expr):
-            return self._comp_application(expr)
+            return self._comp_application(expr, tail)
         else:
             raise self.CompileError("Unknown expression in COMPILE: %s" % expr)
 
+    def _find_local(self, sym):
+        """ Resolve the variable into a LocalVariable referring to the
+            innermost frame that binds it. Return None for global variables.
+        """
+        for depth, frame in enumerate(reversed(self.frames)):
+            # The last binding wins, to match the semantics of define for
+            # repeated argument names.
+            #
+            for index in reversed(range(len(frame))):
+                if frame[index] == sym.value:
+                    if depth > MAX_LOCAL_DEPTH or index > LOCAL_INDEX_MASK:
+                        raise self.CompileError("Too many nested procedures or local variables for: %s" % sym.value)
+                    return LocalVariable(sym.value, depth, index)
+        return None
+
+    def _comp_store(self, sym):
+        local = self._find_local(sym)
+        if local is None:
+            return self._instr(OP_STOREVAR, sym)
+        else:
+            return self._instr(OP_STORELOCAL, local)
+
+    def _collect_definitions(self, expr, names):
+        """ Append to names the variables defined by internal definitions in
+            expr, which is evaluated in the current frame. Walks expr the same
+            way _comp does, without descending into nested procedures (they
+            have their own frames).
+        """
+        if is_self_evaluating(expr) or is_variable(expr) or is_quoted(expr):
+            pass
+        elif is_assignment(expr):
+            self._collect_definitions(assignment_value(expr), names)
+        elif is_definition(expr):
+            name = definition_variable(expr).value
+            if name not in names:
+                names.append(name)
+            self._collect_definitions(definition_value(expr), names)
+        elif is_if(expr):
+            self._collect_definitions(if_predicate(expr), names)
+            self._collect_definitions(if_consequent(expr), names)
+            self._collect_definitions(if_alternative(expr), names)
+        elif is_cond(expr):
+            self._collect_definitions(convert_cond_to_ifs(expr), names)
+        elif is_let(expr):
+            self._collect_definitions(convert_let_to_application(expr), names)
+        elif is_lambda(expr):
+            pass
+        elif is_begin(expr):
+            for action in expand_nested_pairs(begin_actions(expr), recursive=False):
+                self._collect_definitions(action, names)
+        elif is_application(expr):
+            self._collect_definitions(application_operator(expr), names)
+            for arg in expand_nested_pairs(application_operands(expr), recursive=False):
+                self._collect_definitions(arg, names)
+
     def _comp_lambda(self, expr):
         # The lambda parameters are in Scheme's nested Pair format. Convert
         # them into a normal Python list
@@ -152,29 +235,57 @@ class BobCompiler(object):
             else:
                 raise self.CompileError("Expected symbol in argument list, got: %s" % expr_repr(sym))
 
+        # The procedure's frame holds its arguments, followed by the
+        # variables defined in its body.
+        #
+        frame = list(arglist)
+        for body_expr in expand_nested_pairs(lambda_body(expr), recursive=False):
+            self._collect_definitions(body_expr, frame)
+
         # For the code - compile lambda body as a sequence and append a RETURN
         # instruction to the end
         #
-        proc_code = self._instr_seq(self._comp_begin(lambda_body(expr)),
+        self.frames.append(frame)
+        proc_code = self._instr_seq(self._comp_begin(lambda_body(expr), tail=True),
                                     self._instr(OP_RETURN))
+        self.frames.pop()
 
         return self._instr( OP_FUNCTION,
                             CompiledProcedure(
                                 args=arglist,
                                 code=proc_code))
 
-    def _comp_begin(self, exprs):
+    def _comp_begin(self, exprs, tail=False):
         # To compile a 'begin' we append the compiled versions of all the
         # expressions in it, with a POP instruction inserted after each one
         # except the last.
         #
         exprlist = expand_nested_pairs(exprs, recursive=False)
-        return self._comp_exprlist(exprlist)
+        return self._comp_exprlist(exprlist, tail)
 
-    def _comp_exprlist(self, exprlist):
-        instr_pop_pairs = list(self._instr_seq(self._comp(expr), self._instr(OP_POP)) for expr in exprlist)
-        instrs = self._instr_seq(*instr_pop_pairs)
-        return instrs[:-1] if len(instrs) > 0 else instrs
+    def _comp_exprlist(self, exprlist, tail=False):
+        # The value of a sequence is the value of its last expression. The
+        # others are compiled for effect.
+        #
+        if len(exprlist) == 0:
+            return []
+        effects = [self._comp_for_effect(expr) for expr in exprlist[:-1]]
+        return self._instr_seq(*(effects + [self._comp(exprlist[-1], tail)]))
+
+    def _is_store(self, expr):
+        return is_assignment(expr) or is_definition(expr)
+
+    def _comp_for_effect(self, expr):
+        """ Compile an expression whose value is discarded. Definitions and
+            assignments evaluate to () like in the interpreter, but their
+            store instructions already consume the value, so there's nothing
+            to push and pop.
+        """
+        instrs = self._comp(expr)
+        if self._is_store(expr):
+            return instrs[:-1]
+        else:
+            return self._instr_seq(instrs, self._instr(OP_POP))
 
     def _comp_definition(self, expr):
         compiled_val = self._comp(definition_value(expr))
@@ -187,29 +298,52 @@ class BobCompiler(object):
                 isinstance(compiled_val[-1].arg, CompiledProcedure)):
             compiled_val[-1].arg.name = var.value
 
-        return self._instr_seq(compiled_val, self._instr(OP_DEFVAR, var))
+        # Inside a procedure, the variable was given a slot in its frame by
+        # _collect_definitions. At top level, it's a new global variable.
+        #
+        if self.frames:
+            store = self._comp_store(var)
+        else:
+            store = self._instr(OP_DEFVAR, var)
+        return self._instr_seq(compiled_val, store, self._instr(OP_CONST, None))
 
-    def _comp_if(self, expr):
+    def _comp_if(self, expr, tail=False):
         label_else = self._make_label()
         label_after_else = self._make_label()
 
         return self._instr_seq(
                         self._comp(if_predicate(expr)),
                         self._instr(OP_FJUMP, label_else),
-                        self._comp(if_consequent(expr)),
+                        self._comp(if_consequent(expr), tail),
                         self._instr(OP_JUMP, label_after_else),
                         [label_else],
-                        self._comp(if_alternative(expr)),
+                        self._comp(if_alternative(expr), tail),
                         [label_after_else])
 
-    def _comp_application(self, expr):
+    def _comp_application(self, expr, tail=False):
         args = expand_nested_pairs(application_operands(expr), recursive=False)
         compiled_args = self._instr_seq(*[self._comp(arg) for arg in args])
-        compiled_op = self._comp(application_operator(expr))
+        operator = application_operator(expr)
+
+        # Binary applications of the arithmetic and comparison builtins get
+        # their own instructions, unless the operator is a local variable.
+        #
+        if (len(args) == 2 and is_variable(operator) and
+                operator.value in binary_op_builtins and
+                self._find_local(operator) is None):
+            return self._instr_seq(
+                            compiled_args,
+                            self._instr(binary_op_builtins[operator.value], operator))
+
+        compiled_op = self._comp(operator)
+
+        # A call in tail position is the last thing its procedure does, so
+        # TAILCALL lets the VM reuse the procedure's frame for the callee.
+        #
         return self._instr_seq(
                         compiled_args,
                         compiled_op,
-                        self._instr(OP_CALL, len(args)))
+                        self._instr(OP_TAILCALL if tail else OP_CALL, len(args)))
 
 
 class BobAssembler(object):
@@ -253,8 +387,10 @@ class BobAssembler(object):
                     arg = len(co.constants) - 1
                 else:
                     arg = list_find_or_append(co.constants, instr.arg)
-            elif instr.opcode in (OP_LOADVAR, OP_STOREVAR, OP_DEFVAR):
+            elif instr.opcode in (OP_LOADVAR, OP_STOREVAR, OP_DEFVAR) or is_binary_op(instr.opcode):
                 arg = list_find_or_append(co.varnames, instr.arg.value)
+            elif instr.opcode in (OP_LOADLOCAL, OP_STORELOCAL):
+                arg = make_local_arg(instr.arg.depth, instr.arg.index)
             elif instr.opcode == OP_FUNCTION:
                 # Recursively assemble the CompiledProcedure referred to by
                 # this instruction and shove it into the constants list.
@@ -263,7 +399,7 @@ class BobAssembler(object):
                 arg = len(co.constants) - 1
             elif instr.opcode in (OP_FJUMP, OP_JUMP):
                 arg = label_offsets[instr.arg.name]
-            elif instr.opcode == OP_CALL:
+            elif instr.opcode in (OP_CALL, OP_TAILCALL):
                 arg = instr.arg
             elif instr.opcode in (OP_POP, OP_RETURN):
                 arg = None
@@ -45,6 +45,58 @@ def unpack_word(str, big_endian=False):
     return struct.unpack("%sL" % endian, str)[0]
 
 
+def pack_words(words, big_endian=False):
+    """Packs a sequence of 32-bit words into a binary data string."""
+    endian = ">" if big_endian else "<"
+    return struct.pack("%s%dL" % (endian, len(words)), *words)
+
+
+def unpack_words(str, offset, count, big_endian=False):
+    """Unpacks count 32-bit words from binary data, starting at offset."""
+    endian = ">" if big_endian else "<"
+    return struct.unpack_from("%s%dL" % (endian, count), str, offset)
+
+
+def pack_varint(value):
+    """Packs an unsigned integer into a binary data string in the LEB128
+    encoding: 7 bits per byte, least significant first, with the high bit
+    set in all the bytes but the last.
+    """
+    s = bytearray()
+    while value >= 0x80:
+        s.append((value & 0x7F) | 0x80)
+        value >>= 7
+    s.append(value)
+    return bytes(s)
+
+
+def unpack_varint(str, offset):
+    """Unpacks a LEB128-encoded unsigned integer from binary data, starting at
+    offset. Returns the integer and the offset following it.
+    """
+    value = shift = 0
+    while True:
+        b = str[offset]
+        offset += 1
+        value |= (b & 0x7F) << shift
+        if b < 0x80:
+            return value, offset
+        shift += 7
+
+
+def zigzag(value):
+    """Maps a signed 32-bit integer to an unsigned one, so that numbers of
+    small magnitude get small varints: 0, -1, 1, -2, 2... map to 0, 1, 2,
+    3, 4...
+    """
+    return ((value << 1) ^ (value >> 31)) & 0xFFFFFFFF
+
+
+def unzigzag(value):
+    """The inverse of zigzag"""
+    return (value >> 1) ^ -(value & 1)
+
+
 def get_bytes_from_iterator(it, nbytes):
     """Takes a few bytes from an iterator and returns them as a single
     bytes object.
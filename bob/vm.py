@@ -8,8 +8,9 @@
 #-------------------------------------------------------------------------------
 from __future__ import print_function
 from .bytecode import (
-        OP_CONST, OP_LOADVAR, OP_STOREVAR, OP_DEFVAR, OP_FUNCTION, OP_POP,
-        OP_JUMP, OP_FJUMP, OP_RETURN, OP_CALL, opcode2str)
+        OP_CONST, OP_LOADVAR, OP_STOREVAR, OP_DEFVAR, OP_LOADLOCAL,
+        OP_STORELOCAL, OP_FUNCTION, OP_POP, OP_JUMP, OP_FJUMP, OP_RETURN,
+        OP_CALL, OP_TAILCALL, opcode2str, split_local_arg, is_binary_op)
 from .expr import expr_repr, Boolean
 from .builtins import BuiltinProcedure, builtins_map
 from .environment import Environment
@@ -19,9 +20,30 @@ from .utils import Stack
 DEBUG = False
 
 
+class Frame(object):
+    """ The frame of a procedure call: a fixed-size list of slots holding the
+        procedure's arguments and internal definitions, linked to the frame in
+        which the procedure was defined (None for procedures defined at top
+        level, whose free variables are global).
+    """
+    # Marks slots of internal definitions that weren't executed yet.
+    #
+    UNBOUND = object()
+
+    def __init__(self, slots, parent):
+        self.slots = slots
+        self.parent = parent
+
+    def ancestor(self, depth):
+        frame = self
+        for i in range(depth):
+            frame = frame.parent
+        return frame
+
+
 class Closure(object):
     """ A closure is a code object (procedure) with an associated environment
-        in which the closure was defined.
+        (Frame) in which the closure was defined.
     """
     def __init__(self, codeobject, env):
         self.codeobject = codeobject
@@ -36,7 +58,8 @@ class ExecutionFrame(object):
         pc:
             An index into the code object of the next instruction to execute
         env:
-            The environment in which the code is being executed
+            The Frame in which the code is being executed (None for the
+            top-level code)
     """
     def __init__(self, codeobject, pc, env):
         self.codeobject = codeobject
@@ -54,10 +77,11 @@ class BobVM(object):
         self.valuestack = Stack()
         self.framestack = Stack()
 
+        self.global_env = self._create_global_env()
         self.frame = ExecutionFrame(
                         codeobject=None,
                         pc=None,
-                        env=self._create_global_env())
+                        env=None)
 
         if output_stream is None:
             import sys
@@ -92,14 +116,24 @@ class BobVM(object):
             if instr.opcode == OP_CONST:
                 self.valuestack.push(self.frame.codeobject.constants[instr.arg])
             elif instr.opcode == OP_LOADVAR:
-                value = self.frame.env.lookup_var(self.frame.codeobject.varnames[instr.arg])
+                value = self.global_env.lookup_var(self.frame.codeobject.varnames[instr.arg])
                 self.valuestack.push(value)
             elif instr.opcode == OP_STOREVAR:
                 value = self.valuestack.pop()
-                self.frame.env.set_var_value(self.frame.codeobject.varnames[instr.arg], value)
+                self.global_env.set_var_value(self.frame.codeobject.varnames[instr.arg], value)
             elif instr.opcode == OP_DEFVAR:
                 value = self.valuestack.pop()
-                self.frame.env.define_var(self.frame.codeobject.varnames[instr.arg], value)
+                self.global_env.define_var(self.frame.codeobject.varnames[instr.arg], value)
+            elif instr.opcode == OP_LOADLOCAL:
+                depth, index = split_local_arg(instr.arg)
+                value = self.frame.env.ancestor(depth).slots[index]
+                if value is Frame.UNBOUND:
+                    raise self.VMError('Unbound local variable referenced')
+                self.valuestack.push(value)
+            elif instr.opcode == OP_STORELOCAL:
+                depth, index = split_local_arg(instr.arg)
+                value = self.valuestack.pop()
+                self.frame.env.ancestor(depth).slots[index] = value
             elif instr.opcode == OP_POP:
                 if len(self.valuestack) > 0:
                     self.valuestack.pop()
@@ -113,52 +147,71 @@ class BobVM(object):
                 func_codeobject = self.frame.codeobject.constants[instr.arg]
                 closure = Closure(func_codeobject, self.frame.env)
                 self.valuestack.push(closure)
-            elif instr.opcode == OP_CALL:
+            elif instr.opcode in (OP_CALL, OP_TAILCALL):
                 # For CALL what we have on TOS the function and then the
                 # arguments to pass to it - the last argument is highest on
                 # the stack.
                 # The function is either a BuiltinProcedure or a Closure (for
                 # user-defined procedures)
+                # TAILCALL is a CALL that's immediately followed by a return
+                # from the current procedure, so a closure called by it can
+                # take over the current frame instead of saving it.
                 #
                 proc = self.valuestack.pop()
                 argvalues = [self.valuestack.pop() for i in range(instr.arg)]
                 argvalues.reverse()
-
-                if isinstance(proc, BuiltinProcedure):
-                    result = proc.apply(argvalues)
-                    self.valuestack.push(result)
-                elif isinstance(proc, Closure):
-                    if len(proc.codeobject.args) != len(argvalues):
-                        raise self.VMError('Calling procedure %s with %s args, expected %s' % (
-                                                proc.codeobject.name, len(argvalues), len(proc.codeobject.args)))
-
-                    # We're now going to execute a code object, so save the
-                    # current execution frame on the frame stack.
-                    #
-                    self.framestack.push(self.frame)
-
-                    # Extend the closure's environment with the bindings of
-                    # argument names --> passed values.
-                    #
-                    arg_bindings = {}
-                    for i, argname in enumerate(proc.codeobject.args):
-                        arg_bindings[argname] = argvalues[i]
-                    extended_env = Environment(arg_bindings, proc.env)
-
-                    # Start executing the procedure
-                    #
-                    self.frame = ExecutionFrame(
-                                    codeobject=proc.codeobject,
-                                    pc=0,
-                                    env=extended_env)
-                else:
-                    raise self.VMError('Invalid object on TOS for CALL: %s' % proc)
+                self._call(proc, argvalues, tail=(instr.opcode == OP_TAILCALL))
+            elif is_binary_op(instr.opcode):
+                # The arithmetic and comparison instructions apply whatever
+                # is bound to the global named by their argument - normally
+                # the builtin - to the two values on TOS. The barevm has a
+                # fast path for the builtin; here it's just a call, which is
+                # a tail call if the code returns right after it.
+                #
+                proc = self.global_env.lookup_var(self.frame.codeobject.varnames[instr.arg])
+                rhs = self.valuestack.pop()
+                lhs = self.valuestack.pop()
+                self._call(proc, [lhs, rhs], tail=self._returns_next())
 
             elif instr.opcode == OP_RETURN:
                 self.frame = self.framestack.pop()
             else:
                 raise self.VMError('Unknown instruction opcode: %s' % instr.opcode)
 
+    def _call(self, proc, argvalues, tail):
+        """ Call proc with the given arguments. If proc is a closure, the VM
+            starts executing its code; a tail call doesn't save the current
+            execution frame.
+        """
+        if isinstance(proc, BuiltinProcedure):
+            result = proc.apply(argvalues)
+            self.valuestack.push(result)
+        elif isinstance(proc, Closure):
+            if len(proc.codeobject.args) != len(argvalues):
+                raise self.VMError('Calling procedure %s with %s args, expected %s' % (
+                                        proc.codeobject.name, len(argvalues), len(proc.codeobject.args)))
+
+            # We're now going to execute a code object, so save the
+            # current execution frame on the frame stack.
+            #
+            if not tail:
+                self.framestack.push(self.frame)
+
+            # Extend the closure's environment with a frame holding
+            # the passed values in the slots of the arguments.
+            #
+            slots = argvalues + [Frame.UNBOUND] * (proc.codeobject.frame_size() - len(argvalues))
+            extended_env = Frame(slots, proc.env)
+
+            # Start executing the procedure
+            #
+            self.frame = ExecutionFrame(
+                            codeobject=proc.codeobject,
+                            pc=0,
+                            env=extended_env)
+        else:
+            raise self.VMError('Invalid object on TOS for CALL: %s' % proc)
+
     def _get_next_instruction(self):
         """ Get the next instruction from the current code object and advance
             PC. If the code object has no more instructions, return None.
@@ -170,6 +223,20 @@ class BobVM(object):
             self.frame.pc += 1
             return instr
 
+    def _returns_next(self):
+        """ Does the current code object return right after the current
+            instruction, maybe after jumping forward?
+        """
+        code = self.frame.codeobject.code
+        pc = self.frame.pc
+        while pc < len(code):
+            if code[pc].opcode == OP_RETURN:
+                return True
+            elif code[pc].opcode != OP_JUMP or code[pc].arg <= pc:
+                return False
+            pc = code[pc].arg
+        return False
+
     def _is_in_toplevel_code(self):
         """ Is the VM currently executing the top-level code object?
         """
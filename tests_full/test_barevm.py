@@ -7,37 +7,190 @@
 # Eli Bendersky (eliben@gmail.com)
 # This code is in the public domain
 # -------------------------------------------------------------------------------
-import os, sys
-from subprocess import Popen, PIPE
+import io, os, sys
+from subprocess import Popen, PIPE, TimeoutExpired
 import tempfile
 from testcases_utils import run_tests
 
 from bob.compiler import compile_code
-from bob.bytecode import Serializer
+from bob.bytecode import Serializer, _SectionedSerializer, TYPE_CODEOBJECT
+from bob.expr import Number
 
 
-def make_runner(barevm_path):
+# The testcases are run in each of these modes: a name, the bytecode version
+# to serialize with, extra barevm arguments and extra environment variables.
+# Give mode names as arguments to run only these modes; the snapshot mode
+# runs the testcases in testcases_snapshot instead.
+#
+MODES = [
+    ("default", 2, [], {}),
+    ("bytecode-v1", 1, [], {}),
+    # Only bytecode with many code objects (like manyprocs1) is loaded with
+    # several threads
+    ("load-threads", 2, ["--load-threads=4"], {}),
+    # A low threshold makes collections run in most tests
+    ("gc", 2, ["--gc-min-threshold=0"], {}),
+    ("gc-compact", 2, ["--gc-min-threshold=0"], {"BOB_GC_COMPACT": "1"}),
+    ("gc-threads", 2, ["--gc-min-threshold=0"], {"BOB_GC_THREADS": "4"}),
+    ("gc-incremental", 2, ["--gc-min-threshold=0", "--gc-pause-budget=100"], {}),
+]
+
+
+def run_barevm(barevm_path, codeobject, ostream, version=2, args=(), env=None):
+    serialized = Serializer(version).serialize_bytecode(codeobject)
+
+    # Get a temporary filename and write the serialized codeobject
+    # into it
+    fileobj, filename = tempfile.mkstemp()
+    os.write(fileobj, serialized)
+    os.close(fileobj)
+
+    vm_env = dict(os.environ, **env) if env else None
+    vm_proc = Popen([barevm_path] + list(args) + [filename], stdout=PIPE, env=vm_env)
+    vm_output = vm_proc.stdout.read()
+
+    ostream.write(vm_output.decode("utf-8"))
+    os.remove(filename)
+
+
+def make_runner(barevm_path, version=2, args=(), env=None):
     def barevm_runner(code, ostream):
-        codeobject = compile_code(code)
-        serialized = Serializer().serialize_bytecode(codeobject)
+        run_barevm(barevm_path, compile_code(code), ostream, version, args, env)
+
+    return barevm_runner
+
+
+def check_negative_constants(barevm_path):
+    """The parser makes no negative numbers, so put some into a compiled
+    program and check that barevm reads them back from version 2 bytecode.
+    """
+    codeobject = compile_code("(write 1) (write 2)")
+    codeobject.constants = [Number(-5), Number(-(2**31))]
+    ostream = io.StringIO()
+    run_barevm(barevm_path, codeobject, ostream)
+    if ostream.getvalue() != "-5\n-2147483648\n":
+        print("ERROR: negative constants read back as %r" % ostream.getvalue())
+        sys.exit(1)
+
+
+class _NestingCycleSerializer(_SectionedSerializer):
+    """Serializes a program ending with (define (g) (lambda () 0)), but with
+    g's code object in the constant of the lambda, and the lambda's in the
+    constant of g. g is then nested in itself, out of reach of the
+    top-level code object.
+    """
 
-        # Get a temporary filename and write the serialized codeobject
-        # into it
-        fileobj, filename = tempfile.mkstemp()
-        os.write(fileobj, serialized)
+    def serialize_bytecode(self, codeobject):
+        self.toplevel = codeobject
+        return _SectionedSerializer.serialize_bytecode(self, codeobject)
+
+    def _codeobject(self, codeobject):
+        index = _SectionedSerializer._codeobject(self, codeobject)
+        if codeobject is self.toplevel:
+            # The last code object constants are the lambda's and g's
+            lambda_constant, g_constant = [
+                i for i, (type, _) in enumerate(self.constants) if type == TYPE_CODEOBJECT
+            ][-2:]
+            constants = self.constants
+            constants[lambda_constant], constants[g_constant] = (
+                constants[g_constant],
+                constants[lambda_constant],
+            )
+        return index
+
+
+def check_nesting_cycle(barevm_path):
+    """barevm must reject bytecode with a code object nested in itself,
+    also when loading it up front with several threads, which it only does
+    for bytecode with many code objects.
+    """
+    code = "".join("(define (f%d) %d)" % (i, i) for i in range(300))
+    codeobject = compile_code(code + "(define (g) (lambda () 0))")
+    fileobj, filename = tempfile.mkstemp()
+    os.write(fileobj, _NestingCycleSerializer().serialize_bytecode(codeobject))
+    os.close(fileobj)
+
+    for args in ([], ["--load-threads=2"]):
+        vm_proc = Popen([barevm_path] + args + [filename], stdout=PIPE, stderr=PIPE)
+        try:
+            _, vm_error = vm_proc.communicate(timeout=60)
+        except TimeoutExpired:
+            vm_proc.kill()
+            vm_proc.communicate()
+            vm_error = b"timeout"
+        if vm_proc.returncode != 1 or b"nested in itself" not in vm_error:
+            print("ERROR: nesting cycle not rejected with %s: %r" % (args, vm_error))
+            sys.exit(1)
+    os.remove(filename)
+
+
+# Splits a testcase in testcases_snapshot into a prelude and a job
+#
+SNAPSHOT_MARKER = "; ---- job ----"
+
+
+def make_snapshot_runner(barevm_path):
+    """Runs the prelude of a testcase saving a heap image, then the job on
+    top of the image. The output of both should be the same as that of
+    running them together, which is added otherwise.
+    """
+    def snapshot_runner(code, ostream):
+        prelude, job = code.split(SNAPSHOT_MARKER, 1)
+        fileobj, image = tempfile.mkstemp()
         os.close(fileobj)
 
-        vm_proc = Popen([barevm_path, filename], stdout=PIPE)
-        vm_output = vm_proc.stdout.read()
+        split_output = io.StringIO()
+        make_runner(barevm_path, args=["--snapshot-out=" + image])(prelude, split_output)
+        make_runner(barevm_path, args=["--snapshot-in=" + image])(job, split_output)
+        os.remove(image)
 
-        ostream.write(vm_output.decode("utf-8"))
-        os.remove(filename)
+        output = io.StringIO()
+        make_runner(barevm_path)(code, output)
 
-    return barevm_runner
+        ostream.write(split_output.getvalue())
+        if split_output.getvalue() != output.getvalue():
+            ostream.write("---- Running the prelude and the job together:\n")
+            ostream.write(output.getvalue())
+
+    return snapshot_runner
+
+
+def check_snapshot_remembered_set(barevm_path):
+    """A frame slot that is still unbound is loaded from a heap image as 0.
+    The frame lives in the permanent space then, but it must not be
+    remembered, which would make it a root of every collection.
+    """
+    prelude = """
+        (define (f)
+          (define g (lambda () h))
+          (if #f (define h 1))
+          g)
+        (define saved (f))
+    """
+    fileobj, image = tempfile.mkstemp()
+    os.close(fileobj)
+    ostream = io.StringIO()
+    make_runner(barevm_path, args=["--snapshot-out=" + image])(prelude, ostream)
+    make_runner(barevm_path, args=["--snapshot-in=" + image])("(__debug-gc)", ostream)
+    os.remove(image)
+    if "Remembered permanent objects: 0\n" not in ostream.getvalue():
+        print("ERROR: unbound frame slot remembered: %r" % ostream.getvalue())
+        sys.exit(1)
 
 
 if __name__ == "__main__":
     barevm_path = "barevm/barevm"
-    barevm_runner = make_runner(barevm_path)
+    check_negative_constants(barevm_path)
+    check_nesting_cycle(barevm_path)
+    check_snapshot_remembered_set(barevm_path)
+
+    for name, version, args, env in MODES:
+        if len(sys.argv) > 1 and name not in sys.argv[1:]:
+            continue
+        print("==== Mode: %s ====" % name)
+        barevm_runner = make_runner(barevm_path, version, args, env)
+        run_tests(barevm_runner, testdirs=("testcases", "testcases_barevm"))
 
-    run_tests(barevm_runner)
+    if len(sys.argv) == 1 or "snapshot" in sys.argv[1:]:
+        print("==== Mode: snapshot ====")
+        run_tests(make_snapshot_runner(barevm_path), testdirs=("testcases_snapshot",))
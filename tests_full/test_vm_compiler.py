@@ -7,22 +7,46 @@
 # Eli Bendersky (eliben@gmail.com)
 # This code is in the public domain
 # -------------------------------------------------------------------------------
-import sys
+import io, sys
 from testcases_utils import run_tests
 
 from bob.compiler import compile_code
 from bob.vm import BobVM
 from bob.bytecode import Serializer, Deserializer
+from bob.expr import Number
 
 
-def vm_compiler_runner(code, ostream):
-    codeobject = compile_code(code)
+def make_runner(version):
+    def vm_compiler_runner(code, ostream):
+        codeobject = compile_code(code)
 
-    # Run the code through (de+)serialization to exercise it.
+        # Run the code through (de+)serialization to exercise it.
+        ser = Serializer(version).serialize_bytecode(codeobject)
+        codeobject = Deserializer().deserialize_bytecode(ser)
+        vm = BobVM(output_stream=ostream)
+        vm.run(codeobject)
+
+    return vm_compiler_runner
+
+
+def check_negative_constants():
+    """The parser makes no negative numbers, so put some into a compiled
+    program and check that they survive (de)serialization in version 2.
+    """
+    codeobject = compile_code("(write 1) (write 2)")
+    codeobject.constants = [Number(-5), Number(-(2**31))]
     ser = Serializer().serialize_bytecode(codeobject)
     codeobject = Deserializer().deserialize_bytecode(ser)
-    vm = BobVM(output_stream=ostream)
-    vm.run(codeobject)
+    ostream = io.StringIO()
+    BobVM(output_stream=ostream).run(codeobject)
+    if ostream.getvalue() != "-5\n-2147483648\n":
+        print("ERROR: negative constants read back as %r" % ostream.getvalue())
+        sys.exit(1)
+
 
+check_negative_constants()
 
-run_tests(runner=vm_compiler_runner)
+# Exercise both bytecode versions the serializer writes
+for version in (2, 1):
+    print("==== Bytecode version %s ====" % version)
+    run_tests(runner=make_runner(version))
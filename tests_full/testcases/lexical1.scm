@@ -0,0 +1,37 @@
+; Internal definitions and variables of enclosing procedures at various
+; depths
+;
+(define (parity n)
+    (define (ev? k) (if (= k 0) #t (od? (- k 1))))
+    (define (od? k) (if (= k 0) #f (ev? (- k 1))))
+    (list (ev? n) (od? n)))
+
+(write (parity 7))
+
+(define (make-counter start)
+    (let ((count start))
+        (lambda (step)
+            (set! count (+ count step))
+            count)))
+
+(define c1 (make-counter 10))
+(define c2 (make-counter 100))
+(c1 1)
+(c2 5)
+(write (c1 2))
+(write (c2 5))
+
+(define (outer a)
+    (define b (* a 2))
+    (lambda (c)
+        (lambda (d)
+            (list a b c d))))
+
+(write (((outer 1) 3) 4))
+
+(define x 5)
+(define (shadow x)
+    (let ((x (+ x 1)))
+        x))
+(write (shadow 10))
+(write x)
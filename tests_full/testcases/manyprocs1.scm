@@ -0,0 +1,157 @@
+; Generated: a chain of 150 procedures, each with an inner lambda, for more
+; than 256 code objects in all. barevm loads bytecode this large with several
+; threads when asked to.
+(define (f0 x) x)
+(define (f1 x) ((lambda (y) (f0 (+ x y))) 1))
+(define (f2 x) ((lambda (y) (f1 (+ x y))) 2))
+(define (f3 x) ((lambda (y) (f2 (+ x y))) 3))
+(define (f4 x) ((lambda (y) (f3 (+ x y))) 4))
+(define (f5 x) ((lambda (y) (f4 (+ x y))) 5))
+(define (f6 x) ((lambda (y) (f5 (+ x y))) 6))
+(define (f7 x) ((lambda (y) (f6 (+ x y))) 7))
+(define (f8 x) ((lambda (y) (f7 (+ x y))) 8))
+(define (f9 x) ((lambda (y) (f8 (+ x y))) 9))
+(define (f10 x) ((lambda (y) (f9 (+ x y))) 10))
+(define (f11 x) ((lambda (y) (f10 (+ x y))) 11))
+(define (f12 x) ((lambda (y) (f11 (+ x y))) 12))
+(define (f13 x) ((lambda (y) (f12 (+ x y))) 13))
+(define (f14 x) ((lambda (y) (f13 (+ x y))) 14))
+(define (f15 x) ((lambda (y) (f14 (+ x y))) 15))
+(define (f16 x) ((lambda (y) (f15 (+ x y))) 16))
+(define (f17 x) ((lambda (y) (f16 (+ x y))) 17))
+(define (f18 x) ((lambda (y) (f17 (+ x y))) 18))
+(define (f19 x) ((lambda (y) (f18 (+ x y))) 19))
+(define (f20 x) ((lambda (y) (f19 (+ x y))) 20))
+(define (f21 x) ((lambda (y) (f20 (+ x y))) 21))
+(define (f22 x) ((lambda (y) (f21 (+ x y))) 22))
+(define (f23 x) ((lambda (y) (f22 (+ x y))) 23))
+(define (f24 x) ((lambda (y) (f23 (+ x y))) 24))
+(define (f25 x) ((lambda (y) (f24 (+ x y))) 25))
+(define (f26 x) ((lambda (y) (f25 (+ x y))) 26))
+(define (f27 x) ((lambda (y) (f26 (+ x y))) 27))
+(define (f28 x) ((lambda (y) (f27 (+ x y))) 28))
+(define (f29 x) ((lambda (y) (f28 (+ x y))) 29))
+(define (f30 x) ((lambda (y) (f29 (+ x y))) 30))
+(define (f31 x) ((lambda (y) (f30 (+ x y))) 31))
+(define (f32 x) ((lambda (y) (f31 (+ x y))) 32))
+(define (f33 x) ((lambda (y) (f32 (+ x y))) 33))
+(define (f34 x) ((lambda (y) (f33 (+ x y))) 34))
+(define (f35 x) ((lambda (y) (f34 (+ x y))) 35))
+(define (f36 x) ((lambda (y) (f35 (+ x y))) 36))
+(define (f37 x) ((lambda (y) (f36 (+ x y))) 37))
+(define (f38 x) ((lambda (y) (f37 (+ x y))) 38))
+(define (f39 x) ((lambda (y) (f38 (+ x y))) 39))
+(define (f40 x) ((lambda (y) (f39 (+ x y))) 40))
+(define (f41 x) ((lambda (y) (f40 (+ x y))) 41))
+(define (f42 x) ((lambda (y) (f41 (+ x y))) 42))
+(define (f43 x) ((lambda (y) (f42 (+ x y))) 43))
+(define (f44 x) ((lambda (y) (f43 (+ x y))) 44))
+(define (f45 x) ((lambda (y) (f44 (+ x y))) 45))
+(define (f46 x) ((lambda (y) (f45 (+ x y))) 46))
+(define (f47 x) ((lambda (y) (f46 (+ x y))) 47))
+(define (f48 x) ((lambda (y) (f47 (+ x y))) 48))
+(define (f49 x) ((lambda (y) (f48 (+ x y))) 49))
+(define (f50 x) ((lambda (y) (f49 (+ x y))) 50))
+(define (f51 x) ((lambda (y) (f50 (+ x y))) 51))
+(define (f52 x) ((lambda (y) (f51 (+ x y))) 52))
+(define (f53 x) ((lambda (y) (f52 (+ x y))) 53))
+(define (f54 x) ((lambda (y) (f53 (+ x y))) 54))
+(define (f55 x) ((lambda (y) (f54 (+ x y))) 55))
+(define (f56 x) ((lambda (y) (f55 (+ x y))) 56))
+(define (f57 x) ((lambda (y) (f56 (+ x y))) 57))
+(define (f58 x) ((lambda (y) (f57 (+ x y))) 58))
+(define (f59 x) ((lambda (y) (f58 (+ x y))) 59))
+(define (f60 x) ((lambda (y) (f59 (+ x y))) 60))
+(define (f61 x) ((lambda (y) (f60 (+ x y))) 61))
+(define (f62 x) ((lambda (y) (f61 (+ x y))) 62))
+(define (f63 x) ((lambda (y) (f62 (+ x y))) 63))
+(define (f64 x) ((lambda (y) (f63 (+ x y))) 64))
+(define (f65 x) ((lambda (y) (f64 (+ x y))) 65))
+(define (f66 x) ((lambda (y) (f65 (+ x y))) 66))
+(define (f67 x) ((lambda (y) (f66 (+ x y))) 67))
+(define (f68 x) ((lambda (y) (f67 (+ x y))) 68))
+(define (f69 x) ((lambda (y) (f68 (+ x y))) 69))
+(define (f70 x) ((lambda (y) (f69 (+ x y))) 70))
+(define (f71 x) ((lambda (y) (f70 (+ x y))) 71))
+(define (f72 x) ((lambda (y) (f71 (+ x y))) 72))
+(define (f73 x) ((lambda (y) (f72 (+ x y))) 73))
+(define (f74 x) ((lambda (y) (f73 (+ x y))) 74))
+(define (f75 x) ((lambda (y) (f74 (+ x y))) 75))
+(define (f76 x) ((lambda (y) (f75 (+ x y))) 76))
+(define (f77 x) ((lambda (y) (f76 (+ x y))) 77))
+(define (f78 x) ((lambda (y) (f77 (+ x y))) 78))
+(define (f79 x) ((lambda (y) (f78 (+ x y))) 79))
+(define (f80 x) ((lambda (y) (f79 (+ x y))) 80))
+(define (f81 x) ((lambda (y) (f80 (+ x y))) 81))
+(define (f82 x) ((lambda (y) (f81 (+ x y))) 82))
+(define (f83 x) ((lambda (y) (f82 (+ x y))) 83))
+(define (f84 x) ((lambda (y) (f83 (+ x y))) 84))
+(define (f85 x) ((lambda (y) (f84 (+ x y))) 85))
+(define (f86 x) ((lambda (y) (f85 (+ x y))) 86))
+(define (f87 x) ((lambda (y) (f86 (+ x y))) 87))
+(define (f88 x) ((lambda (y) (f87 (+ x y))) 88))
+(define (f89 x) ((lambda (y) (f88 (+ x y))) 89))
+(define (f90 x) ((lambda (y) (f89 (+ x y))) 90))
+(define (f91 x) ((lambda (y) (f90 (+ x y))) 91))
+(define (f92 x) ((lambda (y) (f91 (+ x y))) 92))
+(define (f93 x) ((lambda (y) (f92 (+ x y))) 93))
+(define (f94 x) ((lambda (y) (f93 (+ x y))) 94))
+(define (f95 x) ((lambda (y) (f94 (+ x y))) 95))
+(define (f96 x) ((lambda (y) (f95 (+ x y))) 96))
+(define (f97 x) ((lambda (y) (f96 (+ x y))) 97))
+(define (f98 x) ((lambda (y) (f97 (+ x y))) 98))
+(define (f99 x) ((lambda (y) (f98 (+ x y))) 99))
+(define (f100 x) ((lambda (y) (f99 (+ x y))) 100))
+(define (f101 x) ((lambda (y) (f100 (+ x y))) 101))
+(define (f102 x) ((lambda (y) (f101 (+ x y))) 102))
+(define (f103 x) ((lambda (y) (f102 (+ x y))) 103))
+(define (f104 x) ((lambda (y) (f103 (+ x y))) 104))
+(define (f105 x) ((lambda (y) (f104 (+ x y))) 105))
+(define (f106 x) ((lambda (y) (f105 (+ x y))) 106))
+(define (f107 x) ((lambda (y) (f106 (+ x y))) 107))
+(define (f108 x) ((lambda (y) (f107 (+ x y))) 108))
+(define (f109 x) ((lambda (y) (f108 (+ x y))) 109))
+(define (f110 x) ((lambda (y) (f109 (+ x y))) 110))
+(define (f111 x) ((lambda (y) (f110 (+ x y))) 111))
+(define (f112 x) ((lambda (y) (f111 (+ x y))) 112))
+(define (f113 x) ((lambda (y) (f112 (+ x y))) 113))
+(define (f114 x) ((lambda (y) (f113 (+ x y))) 114))
+(define (f115 x) ((lambda (y) (f114 (+ x y))) 115))
+(define (f116 x) ((lambda (y) (f115 (+ x y))) 116))
+(define (f117 x) ((lambda (y) (f116 (+ x y))) 117))
+(define (f118 x) ((lambda (y) (f117 (+ x y))) 118))
+(define (f119 x) ((lambda (y) (f118 (+ x y))) 119))
+(define (f120 x) ((lambda (y) (f119 (+ x y))) 120))
+(define (f121 x) ((lambda (y) (f120 (+ x y))) 121))
+(define (f122 x) ((lambda (y) (f121 (+ x y))) 122))
+(define (f123 x) ((lambda (y) (f122 (+ x y))) 123))
+(define (f124 x) ((lambda (y) (f123 (+ x y))) 124))
+(define (f125 x) ((lambda (y) (f124 (+ x y))) 125))
+(define (f126 x) ((lambda (y) (f125 (+ x y))) 126))
+(define (f127 x) ((lambda (y) (f126 (+ x y))) 127))
+(define (f128 x) ((lambda (y) (f127 (+ x y))) 128))
+(define (f129 x) ((lambda (y) (f128 (+ x y))) 129))
+(define (f130 x) ((lambda (y) (f129 (+ x y))) 130))
+(define (f131 x) ((lambda (y) (f130 (+ x y))) 131))
+(define (f132 x) ((lambda (y) (f131 (+ x y))) 132))
+(define (f133 x) ((lambda (y) (f132 (+ x y))) 133))
+(define (f134 x) ((lambda (y) (f133 (+ x y))) 134))
+(define (f135 x) ((lambda (y) (f134 (+ x y))) 135))
+(define (f136 x) ((lambda (y) (f135 (+ x y))) 136))
+(define (f137 x) ((lambda (y) (f136 (+ x y))) 137))
+(define (f138 x) ((lambda (y) (f137 (+ x y))) 138))
+(define (f139 x) ((lambda (y) (f138 (+ x y))) 139))
+(define (f140 x) ((lambda (y) (f139 (+ x y))) 140))
+(define (f141 x) ((lambda (y) (f140 (+ x y))) 141))
+(define (f142 x) ((lambda (y) (f141 (+ x y))) 142))
+(define (f143 x) ((lambda (y) (f142 (+ x y))) 143))
+(define (f144 x) ((lambda (y) (f143 (+ x y))) 144))
+(define (f145 x) ((lambda (y) (f144 (+ x y))) 145))
+(define (f146 x) ((lambda (y) (f145 (+ x y))) 146))
+(define (f147 x) ((lambda (y) (f146 (+ x y))) 147))
+(define (f148 x) ((lambda (y) (f147 (+ x y))) 148))
+(define (f149 x) ((lambda (y) (f148 (+ x y))) 149))
+
+(write (f149 0))
+(write (f75 1))
+(write (f1 (f2 (f3 0))))
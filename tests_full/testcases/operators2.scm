@@ -0,0 +1,19 @@
+; Arithmetic and comparison operators that are shadowed by local variables
+; or redefined by the program
+;
+(define (apply-op + a b) (+ a b))
+(write (apply-op * 6 7))
+
+(define (shadow-let a b)
+    (let ((< >))
+        (< a b)))
+(write (shadow-let 1 2))
+
+(define (sum3 a b c) (+ (+ a b) c))
+(write (sum3 1 2 3))
+
+(define saved-plus +)
+(define (+ a b) (saved-plus (saved-plus a b) 1000))
+(write (sum3 1 2 3))
+(write (- 10 (* 2 3)))
+(write (list (= 1 1) (< 1 2) (> 1 2) (<= 2 2) (>= 1 2)))
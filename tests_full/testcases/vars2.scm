@@ -0,0 +1,24 @@
+; Global variables referenced from procedures, before and after they are
+; redefined or assigned
+;
+(define (helper x) (* x 2))
+(define (use-helper x) ((lambda (y) (helper y)) x))
+
+(write (use-helper 5))
+(define (helper x) (+ x 100))
+(write (use-helper 5))
+
+(define total 0)
+(define (add-to-total! n) (set! total (+ total n)))
+(add-to-total! 3)
+(add-to-total! 4)
+(write total)
+(define total 10)
+(add-to-total! 1)
+(write total)
+
+(define (get-later) later)
+(define later 'defined-after-use)
+(write (get-later))
+(set! later 'assigned)
+(write (get-later))
@@ -0,0 +1,68 @@
+; Keeps a long list alive across forced collections while mutating it, so
+; that old cells end up pointing at young ones and the other way around.
+(define (make-list n acc)
+  (if (= n 0)
+      acc
+      (make-list (- n 1) (cons n acc))))
+
+; The sum of the cars, modulo a prime to stay clear of overflows
+(define (sum-cars lst acc)
+  (if (null? lst)
+      acc
+      (sum-cars (cdr lst) (modulo (+ acc (car lst)) 1000003))))
+
+(define (len lst acc)
+  (if (null? lst)
+      acc
+      (len (cdr lst) (+ acc 1))))
+
+(define lst (make-list 100000 '()))
+(__run-gc)
+(write (len lst 0))
+(write (sum-cars lst 0))
+
+; Replace each car with a fresh pair, then collect
+(define (box-cars! lst)
+  (if (null? lst)
+      'done
+      (begin
+        (set-car! lst (cons (car lst) (car lst)))
+        (box-cars! (cdr lst)))))
+(box-cars! lst)
+(__run-gc)
+
+(define (unbox-cars! lst)
+  (if (null? lst)
+      'done
+      (begin
+        (set-car! lst (+ (car (car lst)) (cdr (car lst))))
+        (unbox-cars! (cdr lst)))))
+(unbox-cars! lst)
+(write (sum-cars lst 0))
+
+; Splice a fresh cell after every cell, collecting every 10000 cells
+(define (splice! lst n)
+  (if (null? lst)
+      'done
+      (begin
+        (set-cdr! lst (cons 1 (cdr lst)))
+        (if (= (modulo n 10000) 0) (__run-gc) 'no-gc)
+        (splice! (cdr (cdr lst)) (+ n 1)))))
+(splice! lst 1)
+(__run-gc)
+(write (len lst 0))
+(write (sum-cars lst 0))
+
+; Reverse the list in place
+(define (reverse! lst acc)
+  (if (null? lst)
+      acc
+      (let ((next (cdr lst)))
+        (set-cdr! lst acc)
+        (reverse! next lst))))
+(set! lst (reverse! lst '()))
+(__run-gc)
+(write (car lst))
+(write (car (cdr lst)))
+(write (len lst 0))
+(write (sum-cars lst 0))
@@ -0,0 +1,22 @@
+; Arithmetic that overflows 32 bits wraps around, both in the instructions
+; for + - * and in the builtins they fall back to. 2^30 doesn't fit a
+; fixnum on 32-bit platforms, where it's boxed instead.
+(define big 2147483647)
+(define small (- 0 big 1))
+(write (+ big 1))
+(write (- small 1))
+(write (* big 2))
+(write (* 65536 65536))
+(write (* 46341 46341))
+(write (+ 1073741823 1))
+(write (* 32768 32768))
+
+(define add +)
+(define sub -)
+(define mul *)
+(write (add big 1))
+(write (sub small 1))
+(write (mul big 2))
+(write (mul 65536 65536))
+(write (add big 1 big))
+(write (= (+ big 1) small))
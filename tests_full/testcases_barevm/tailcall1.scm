@@ -0,0 +1,23 @@
+; Loops a million times through tail calls. Proper tail calls run them in
+; constant space: __debug-vm shows the frame stack at the end of each loop.
+(define (count-down n)
+  (if (= n 0)
+      (begin (__debug-vm) 'done)
+      (count-down (- n 1))))
+
+(define (my-even? n)
+  (if (= n 0)
+      (begin (__debug-vm) #t)
+      (my-odd? (- n 1))))
+(define (my-odd? n)
+  (if (= n 0)
+      #f
+      (my-even? (- n 1))))
+
+(define (sum-to n acc)
+  (cond ((= n 0) acc)
+        (else (sum-to (- n 1) (+ acc 2)))))
+
+(write (count-down 1000000))
+(write (my-even? 1000000))
+(write (sum-to 1000000 0))
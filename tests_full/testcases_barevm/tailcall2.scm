@@ -0,0 +1,10 @@
+; The arithmetic and comparison instructions call whatever is bound to their
+; operator's name when it isn't the builtin. Such calls in tail position are
+; tail calls too, so this loop runs in constant space.
+(define (loop n)
+  (if (= n 0)
+      (begin (__debug-vm) 'done)
+      (< n 1)))
+(define (< a b) (loop (- a 1)))
+
+(write (loop 1000000))
@@ -0,0 +1,35 @@
+; The prelude leaves closures over captured frames, a quoted list and a
+; rebound builtin behind.
+(define (make-counter start)
+  (let ((n start))
+    (lambda ()
+      (set! n (+ n 1))
+      n)))
+(define counter (make-counter 10))
+(write (counter))
+
+(define (make-adder k) (lambda (x) (+ x k)))
+(define add5 (make-adder 5))
+(define add-counted (make-adder (counter)))
+
+(define colors '(red green (blue 3) #t 42))
+
+(define mul-calls 0)
+(define builtin-mul *)
+(define (* a b)
+  (set! mul-calls (+ mul-calls 1))
+  (builtin-mul a b))
+(write (* 2 3))
+
+; ---- job ----
+; The job uses the state the prelude left behind.
+(write (counter))
+(write (counter))
+(write (add5 10))
+(write (add-counted 100))
+(write colors)
+(write (car (cdr (cdr colors))))
+(write (eq? (car colors) 'red))
+(write (* 6 7))
+(write (* (add5 1) 2))
+(write mul-calls)
@@ -19,9 +19,14 @@ class TestCase(object):
         self.expected = expected
 
 
-def all_testcases():
+def all_testcases(testdirs=("testcases",)):
     basedir = os.path.dirname(os.path.abspath(__file__))
-    testdir = os.path.join(basedir, "testcases")
+    for testdir in testdirs:
+        for testcase in _testcases_in(os.path.join(basedir, testdir)):
+            yield testcase
+
+
+def _testcases_in(testdir):
     for filename in sorted(os.listdir(testdir)):
         if filename.endswith(".scm"):
             testname = os.path.splitext(filename)[0]
@@ -34,19 +39,21 @@ def all_testcases():
             yield TestCase(testname, code, expected)
 
 
-def run_tests(runner, testnames=None):
+def run_tests(runner, testnames=None, testdirs=("testcases",)):
     """Runs all tests found under the testcases directory next to this file
     with the given runner. A runner is a function accepting Scheme code as a
     string and an output stream for calls to 'write' - it's expected to run
     the code.
 
     If testnames is given, only tests with names in that list are run.
+    testdirs lists the directories next to this file to look for tests in;
+    testcases_barevm holds tests only barevm can run.
     """
     starttime = time.time()
     testcount = 1
     errorcount = 0
 
-    for testcase in all_testcases():
+    for testcase in all_testcases(testdirs):
         if testnames is not None and testcase.name not in testnames:
             continue
         numdots = 25 - len(testcase.name)